@@ -9,9 +9,12 @@ include $(PREBUILT_STATIC_LIBRARY)
 include $(CLEAR_VARS)
 APP_CPPFLAGS += -Wno-error=format-security
 LOCAL_CFLAGS += -Wno-error=format-security
+# libmyjpeg.a includes the TurboJPEG API
+LOCAL_CFLAGS += -DHAVE_TURBOJPEG
 #LOCAL_CFLAGS := -fno-strict-overflow -Wno-error
 LOCAL_MODULE    := libjpeg2yuv
-LOCAL_SRC_FILES = jpg2yuv.c jpegutils.c lav_io.c avilib.c mjpeg_logging.c 
+LOCAL_SRC_FILES = jpg2yuv.c jpegutils.c lav_io.c avilib.c mjpeg_logging.c \
+                  yuv_resample.c yuv_resample_neon.c.neon
 
 LOCAL_LDLIBS := -llog
 #LOCAL_LDLIBS += -L$(LOCAL_PATH)/  -lWeaverVideoCodec
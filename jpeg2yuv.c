@@ -36,6 +36,7 @@ jpeg2yuv
 #include "lav_io.h"
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
 
 #include "mjpeg_logging.h"
@@ -44,8 +45,6 @@ jpeg2yuv
 #include "yuv4mpeg.h"
 #include "mpegconsts.h"
 
-#define MAXPIXELS (2048*2048)  /* Maximum size of final image */
-
 
 
 typedef struct _parameters {
@@ -62,13 +61,11 @@ typedef struct _parameters {
   int colorspace;
   int loop;
   int rescale_YUV;
+  int native_chroma; /* keep the chroma subsampling of the JPEGs? */
+  int chroma;      /* Y4M_CHROMA_* of the output stream */
 } parameters_t;
 
 
-static struct jpeg_decompress_struct dinfo;
-static struct jpeg_error_mgr jerr;
-
-
 
 /*
  * The User Interface parts 
@@ -104,6 +101,9 @@ static void usage(char *prog)
       "                                 fields per JPEG file)\n"
       "                            1 = interleaved fields\n"
       "  -R 1/0 ... 1: rescale YUV color values from 0-255 to 16-235 (default: 1)\n"
+      "  -c x  output chroma:  420 = always 4:2:0               [420]\n"
+      "                        native = as in the JPEG (4:4:4, 4:2:2,\n"
+      "                                 4:1:1, 4:2:0 or mono), no resampling\n"
       "\n"
       "%s pipes a sequence of JPEG files to stdout,\n"
       "making the direct encoding of MPEG files possible under mpeg2enc.\n"
@@ -145,10 +145,12 @@ static void parse_commandline(int argc, char ** argv, parameters_t *param)
   param->verbose = 1;
   param->loop = 1;
   param->rescale_YUV = 1;
+  param->native_chroma = 0;
+  param->chroma = Y4M_CHROMA_420JPEG;
 
   /* parse options */
   for (;;) {
-    if (-1 == (c = getopt(argc, argv, "I:hv:L:b:j:n:f:l:R:")))
+    if (-1 == (c = getopt(argc, argv, "I:hv:L:b:j:n:f:l:R:c:")))
       break;
     switch (c) {
 
@@ -164,6 +166,14 @@ static void parse_commandline(int argc, char ** argv, parameters_t *param)
     case 'R':
       param->rescale_YUV = atoi(optarg);
       break;
+    case 'c':
+      if (strcmp(optarg, "native") == 0)
+        param->native_chroma = 1;
+      else if (strcmp(optarg, "420") == 0)
+        param->native_chroma = 0;
+      else
+        mjpeg_error_exit1 ("-c option requires arg 420 or native");
+      break;
     case 'f':
       param->framerate = mpeg_conform_framerate(atof(optarg));
       break;
@@ -226,77 +236,75 @@ static void parse_commandline(int argc, char ** argv, parameters_t *param)
  * The file handling parts 
  */
 
+/** jpeg_native_chroma
+ * Maps the sampling factors of a JPEG to the Y4M chroma mode that holds
+ * them without resampling.  Layouts the decoder can't keep as they are
+ * come out as 4:2:0.
+ */
+static int jpeg_native_chroma(const jpeg2yuv_info_t *info)
+{
+  if (info->components == 1)
+    return Y4M_CHROMA_MONO;
+  if (info->h_samp[1] != 1 || info->v_samp[1] != 1 ||
+      info->h_samp[2] != 1 || info->v_samp[2] != 1)
+    return Y4M_CHROMA_420JPEG;
+  if (info->v_samp[0] == 1)
+    switch (info->h_samp[0]) {
+    case 1: return Y4M_CHROMA_444;
+    case 2: return Y4M_CHROMA_422;
+    case 4: return Y4M_CHROMA_411;
+    }
+  return Y4M_CHROMA_420JPEG;
+}
+
 /** init_parse_files
- * Verifies the JPEG input files and prepares YUV4MPEG header information.
+ * Verifies a JPEG input file, already read into memory, and prepares
+ * YUV4MPEG header information.  Only the markers are parsed.
  * @returns 0 on success
  */
-static int init_parse_files(parameters_t *param, char *filename)
+static int init_parse_files(parameters_t *param, const char *jpegname,
+                            const uint8_t *jpegdata, size_t jpegsize)
 { 
-  char jpegname[255];
-  FILE *jpegfile;
+  jpeg2yuv_info_t info;
 
-/*  
-  snprintf(jpegname, sizeof(jpegname), 
-       param->jpegformatstr, param->begin);
-*/
-  strcpy(jpegname, filename);
   mjpeg_info("Parsing file %s", jpegname);
 
   mjpeg_debug("Analyzing %s to get the right pic params", jpegname);
-  jpegfile = fopen(jpegname, "rb");
-  
-  if (jpegfile == NULL) {
-    mjpeg_error_exit1("System error while opening: \"%s\": %s",
-              jpegname, strerror(errno));
+  if (jpeg2yuv_probe(jpegdata, jpegsize, &info) < 0) {
+    mjpeg_error("No JPEG header found in %s.", jpegname);
     return 1;
   }
 
-  /* Now open this JPEG file, and examine its header to retrieve the 
-     YUV4MPEG info that shall be written */
-  dinfo.err = jpeg_std_error(&jerr);  /* ?????????? */
-  jpeg_create_decompress(&dinfo);
-  jpeg_stdio_src(&dinfo, jpegfile);
-  jpeg_read_header(&dinfo, 1);
-  switch (dinfo.jpeg_color_space)
+  switch (info.components)
     {
-    case JCS_YCbCr:
+    case 3:
       mjpeg_info("YUV colorspace detected.\n"); 
-      dinfo.out_color_space = JCS_YCbCr;      
+      param->colorspace = JCS_YCbCr;
       break;
-    case JCS_GRAYSCALE:
+    case 1:
       mjpeg_info("Grayscale colorspace detected.\n"); 
-      dinfo.out_color_space = JCS_GRAYSCALE;      
+      param->colorspace = JCS_GRAYSCALE;
       break;
     default:
-      mjpeg_error("Unsupported colorspace detected.\n"); break;
+      mjpeg_error("Unsupported colorspace detected.\n");
+      return 1;
     }
 
-  mjpeg_info("Starting decompression");
-
-  jpeg_start_decompress(&dinfo);
-  
-  if (dinfo.output_components != 3 && dinfo.out_color_space == JCS_YCbCr)
-    mjpeg_error_exit1("Output components of color JPEG image = %d, must be 3.",
-              dinfo.output_components);
-
-  if (dinfo.output_components != 1 && dinfo.out_color_space == JCS_GRAYSCALE)
-    mjpeg_error_exit1("Output components of grayscale JPEG image = %d, must be 1.",
-              dinfo.output_components);
-  
   mjpeg_info("Image dimensions are %dx%d",
-         dinfo.image_width, dinfo.image_height);
+         info.width, info.height);
   /* picture size check  */
-  if ( (dinfo.image_width % 2) != 0 )
+  if ( (info.width % 2) != 0 )
     mjpeg_error_exit1("The image width has to be a even number, rescale the image");
-  if ( (dinfo.image_height % 2) != 0 )
+  if ( (info.height % 2) != 0 )
     mjpeg_error_exit1("The image height has to be even number, rescale the image");
 
-  param->width = dinfo.image_width;
-  param->height = dinfo.image_height;
-  param->colorspace = dinfo.jpeg_color_space;
-  
-  jpeg_destroy_decompress(&dinfo);
-  fclose(jpegfile);
+  param->width = info.width;
+  param->height = info.height;
+  param->chroma = param->native_chroma ?
+    jpeg_native_chroma(&info) : Y4M_CHROMA_420JPEG;
+  if (param->chroma == Y4M_CHROMA_411 && (info.width % 4) != 0)
+    mjpeg_error_exit1("The image width has to be a multiple of 4 for 4:1:1");
+  mjpeg_info("Output chroma: %s", y4m_chroma_description(param->chroma));
 
   mjpeg_info("Movie frame rate is:  %f frames/second",
          Y4M_RATIO_DBL(param->framerate));
@@ -328,25 +336,42 @@ static int init_parse_files(parameters_t *param, char *filename)
   return 0;
 }
 
-/**
-  Rescales the YUV values from the range 0..255 to the range 16..235 
-  @param yp: buffer for Y plane of decoded JPEG 
-  @param up: buffer for U plane of decoded JPEG 
-  @param vp: buffer for V plane of decoded JPEG 
-*/
-static void rescale_color_vals(int width, int height, uint8_t *yp, uint8_t *up, uint8_t *vp) 
+/** write_frame
+ * Same output as y4m_write_frame(), but the planes go to the kernel in
+ * a single writev().  Planes may share a buffer, as the neutral chroma
+ * planes of gray input do.
+ * @returns Y4M_OK on success
+ */
+static int write_frame(int fd, const y4m_stream_info_t *si,
+                       const y4m_frame_info_t *fi, uint8_t * const *planes)
 {
-  int x,y;
-  for (y = 0; y < height; y++)
-    for (x = 0; x < width; x++)
-      yp[x+y*width] = (float)(yp[x+y*width])/255.0 * (235.0 - 16.0) + 16.0;
-
-  for (y = 0; y < height/2; y++)
-    for (x = 0; x < width/2; x++)
-      {
-    up[x+y*width/2] = (float)(up[x+y*width/2])/255.0 * (240.0 - 16.0) + 16.0;
-    vp[x+y*width/2] = (float)(vp[x+y*width/2])/255.0 * (240.0 - 16.0) + 16.0;
-      }
+  struct iovec iov[Y4M_MAX_NUM_PLANES];
+  int n = y4m_si_get_plane_count(si);
+  int i, err;
+  ssize_t done;
+
+  if ((err = y4m_write_frame_header(fd, si, fi)) != Y4M_OK)
+    return err;
+
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = planes[i];
+    iov[i].iov_len = y4m_si_get_plane_length(si, i);
+  }
+  for (i = 0; i < n; ) {
+    done = writev(fd, iov + i, n - i);
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      return Y4M_ERR_SYSTEM;
+    }
+    for (; i < n && (size_t)done >= iov[i].iov_len; i++)
+      done -= iov[i].iov_len;
+    if (i < n) {
+      iov[i].iov_base = (uint8_t *)iov[i].iov_base + done;
+      iov[i].iov_len -= done;
+    }
+  }
+  return Y4M_OK;
 }
 
 static int generate_YUV4MPEG(parameters_t *param)
@@ -357,9 +382,17 @@ static int generate_YUV4MPEG(parameters_t *param)
   FILE *jpegfile;
   int loops;                                 /* number of loops to go */
   uint8_t *yuv[3];  /* buffer for Y/U/V planes of decoded JPEG */
-  static uint8_t jpegdata[MAXPIXELS];  /* that ought to be enough */
+  uint8_t *planes[3];  /* what is written: yuv[], or neutral for gray */
+  uint8_t *neutral = NULL;  /* chroma of gray frames, shared by U and V */
+  int neutral_len = 0;
+  int gray, len;
+  uint8_t *jpegdata = NULL;  /* grown to the largest file read so far */
+  size_t jpegdata_size = 0;
+  long filesize;
+  int i;
   y4m_stream_info_t streaminfo;
   y4m_frame_info_t frameinfo;
+  jpeg2yuv_decoder_t *dec;
   loops = param->loop;
   DIR *dirp;
   struct dirent *dp;
@@ -372,9 +405,16 @@ static int generate_YUV4MPEG(parameters_t *param)
 
   mjpeg_info("Now generating YUV4MPEG stream.");
 
+  /* -R 1: the decoder stores studio range directly */
+  dec = jpeg2yuv_decoder_create();
+  if (dec == NULL)
+    mjpeg_error_exit1("Could not allocate the JPEG decoder.");
+  jpeg2yuv_decoder_set_studio_range(dec, param->rescale_YUV);
+
   dirp = opendir(param->jpegformatstr);
   if (dirp == NULL) {
            mjpeg_info("Could not open input directory.");
+       jpeg2yuv_decoder_destroy(dec);
        return 1;
   } else {
            mjpeg_info("Opening input directory.");
@@ -387,7 +427,25 @@ static int generate_YUV4MPEG(parameters_t *param)
     if (!strstr(dp->d_name, ".jpg") && !strstr(dp->d_name, ".JPG") && !strstr(dp->d_name, ".jpeg") && !strstr(dp->d_name, ".JPEG"))
         continue;
 
-    if (init_parse_files(param, jpegname))
+    /* Each file is read once; its header is probed from the buffer */
+    jpegfile = fopen(jpegname, "rb");
+    if (jpegfile == NULL)
+      mjpeg_error_exit1("System error while opening: \"%s\": %s",
+                        jpegname, strerror(errno));
+    fseek(jpegfile, 0, SEEK_END);
+    filesize = ftell(jpegfile);
+    rewind(jpegfile);
+    if (filesize > 0 && (size_t)filesize > jpegdata_size) {
+      jpegdata = realloc(jpegdata, filesize);
+      if (jpegdata == NULL)
+        mjpeg_error_exit1("Could not allocate %ld bytes for %s.",
+                          filesize, dp->d_name);
+      jpegdata_size = filesize;
+    }
+    jpegsize = fread(jpegdata, sizeof(unsigned char), jpegdata_size, jpegfile); 
+    fclose(jpegfile);
+
+    if (init_parse_files(param, jpegname, jpegdata, jpegsize))
         continue;
 
     y4m_init_stream_info(&streaminfo);
@@ -397,31 +455,35 @@ static int generate_YUV4MPEG(parameters_t *param)
     y4m_si_set_height(&streaminfo, param->height);
     y4m_si_set_interlace(&streaminfo, param->interlace);
     y4m_si_set_framerate(&streaminfo, param->framerate);
-
-    yuv[0] = realloc(yuv[0], param->width * param->height * sizeof(yuv[0][0]));
-    yuv[1] = realloc(yuv[1], param->width * param->height / 4 * sizeof(yuv[1][0]));
-    yuv[2] = realloc(yuv[2], param->width * param->height / 4 * sizeof(yuv[2][0]));
+    y4m_si_set_chroma(&streaminfo, param->chroma);
+
+    /* Gray JPEGs have the same neutral chroma in every frame.  Unless the
+       stream is mono it is filled in once per geometry, both chroma
+       planes are written from that one buffer and the decoder only
+       produces luma.  127 is neutral in full and in studio range. */
+    gray = param->colorspace == JCS_GRAYSCALE;
+    for (i = 0; i < y4m_si_get_plane_count(&streaminfo); i++) {
+      len = y4m_si_get_plane_length(&streaminfo, i);
+      if (i > 0 && gray) {
+        if (len != neutral_len) {
+          neutral = realloc(neutral, len);
+          memset(neutral, 127, len);
+          neutral_len = len;
+        }
+        planes[i] = neutral;
+      } else {
+        yuv[i] = realloc(yuv[i], len);
+        planes[i] = yuv[i];
+      }
+    }
 
     y4m_write_stream_header(STDOUT_FILENO, &streaminfo);
 
    
 //       snprintf(jpegname, sizeof(jpegname), param->jpegformatstr, frame);
-       jpegfile = fopen(jpegname, "rb");
-       
-       if (jpegfile == NULL) { 
-         mjpeg_info("Read from '%s' failed:  %s", dp->d_name, strerror(errno));
-         if (param->numframes == -1) {
-           mjpeg_info("No more frames.  Stopping.");
-           break;  /* we are done; leave 'while' loop */
-         } else {
-           mjpeg_info("Rewriting latest frame instead.");
-         }
-       } else {
+       {
          mjpeg_debug("Preparing frame");
          
-         jpegsize = fread(jpegdata, sizeof(unsigned char), MAXPIXELS, jpegfile); 
-         fclose(jpegfile);
-         
          /* decode_jpeg_raw:s parameters from 20010826
           * jpeg_data:       buffer with input / output jpeg
           * len:             Length of jpeg buffer
@@ -441,12 +503,12 @@ static int generate_YUV4MPEG(parameters_t *param)
            mjpeg_info("Processing non-interlaced/interleaved %s, size %ul.", 
                       dp->d_name, jpegsize);
        if (param->colorspace == JCS_GRAYSCALE)
-           decode_jpeg_gray_raw(jpegdata, jpegsize,
-                    0, 420, param->width, param->height,
-                    yuv[0], yuv[1], yuv[2]);
+           decode_jpeg_gray_raw_ctx(dec, jpegdata, jpegsize,
+                    0, param->chroma, param->width, param->height,
+                    yuv[0], NULL, NULL);
        else
-         decode_jpeg_raw(jpegdata, jpegsize,
-                 0, 420, param->width, param->height,
+         decode_jpeg_raw_ctx(dec, jpegdata, jpegsize,
+                 0, param->chroma, param->width, param->height,
                  yuv[0], yuv[1], yuv[2]);
          } else {
            switch (param->interlace) {
@@ -454,28 +516,28 @@ static int generate_YUV4MPEG(parameters_t *param)
              mjpeg_info("Processing interlaced, top-first %s, size %ul.",
                         jpegname, jpegsize);
          if (param->colorspace == JCS_GRAYSCALE)
-           decode_jpeg_gray_raw(jpegdata, jpegsize,
+           decode_jpeg_gray_raw_ctx(dec, jpegdata, jpegsize,
                     LAV_INTER_TOP_FIRST, 
-                    420, param->width, param->height,
-                    yuv[0], yuv[1], yuv[2]);
+                    param->chroma, param->width, param->height,
+                    yuv[0], NULL, NULL);
          else
-           decode_jpeg_raw(jpegdata, jpegsize,
+           decode_jpeg_raw_ctx(dec, jpegdata, jpegsize,
                    LAV_INTER_TOP_FIRST,
-                   420, param->width, param->height,
+                   param->chroma, param->width, param->height,
                    yuv[0], yuv[1], yuv[2]);
              break;
            case Y4M_ILACE_BOTTOM_FIRST:
              mjpeg_info("Processing interlaced, bottom-first %s, size %ul.", 
                         jpegname, jpegsize);
          if (param->colorspace == JCS_GRAYSCALE)
-           decode_jpeg_gray_raw(jpegdata, jpegsize,
+           decode_jpeg_gray_raw_ctx(dec, jpegdata, jpegsize,
                     LAV_INTER_BOTTOM_FIRST, 
-                    420, param->width, param->height,
-                    yuv[0], yuv[1], yuv[2]);
+                    param->chroma, param->width, param->height,
+                    yuv[0], NULL, NULL);
          else
-           decode_jpeg_raw(jpegdata, jpegsize,
+           decode_jpeg_raw_ctx(dec, jpegdata, jpegsize,
                    LAV_INTER_BOTTOM_FIRST,
-                   420, param->width, param->height,
+                   param->chroma, param->width, param->height,
                    yuv[0], yuv[1], yuv[2]);
              break;
            default:
@@ -483,18 +545,12 @@ static int generate_YUV4MPEG(parameters_t *param)
              break;
            }
          }
-
-     if (param->rescale_YUV)
-       {
-         mjpeg_info("Rescaling color values.");
-         rescale_color_vals(param->width, param->height, yuv[0], yuv[1], yuv[2]);
-       }
      mjpeg_debug("Frame decoded, now writing to output stream.");
        }
    
   loops = param->loop;
   do { /* while */
-       y4m_write_frame(STDOUT_FILENO, &streaminfo, &frameinfo, yuv);
+       write_frame(STDOUT_FILENO, &streaminfo, &frameinfo, planes);
      if (param->loop != -1)
        loops--;
  
@@ -510,6 +566,9 @@ static int generate_YUV4MPEG(parameters_t *param)
   free(yuv[0]);
   free(yuv[1]);
   free(yuv[2]);
+  free(jpegdata);
+  free(neutral);
+  jpeg2yuv_decoder_destroy(dec);
 
   return 0;
 }
@@ -28,16 +28,22 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
+#include <pthread.h>
 #include <jpeglib.h>
 #include <jerror.h>
 #include <assert.h>
+#ifdef HAVE_TURBOJPEG
+#include "turbojpeg.h"
+#endif
 
 #include "mjpeg_logging.h"
 
 #include "jpegutils.h"
 #include "lav_io.h"
+#include "yuv_resample.h"
 
  /*
  * jpeg_data:       buffer with input / output jpeg
@@ -59,8 +65,30 @@ static void jpeg_buffer_src  (j_decompress_ptr cinfo, unsigned char *buffer,
                        long num);
 static void jpeg_buffer_dest (j_compress_ptr cinfo,   unsigned char *buffer,
                        long len);
+static void jpeg_grow_dest   (j_compress_ptr cinfo,   unsigned char **buffer,
+                       long *len);
+static int grow_buffer (void **buf, long *size, long need);
+static int encode_frame (jpeg2yuv_decoder_t *dec,
+                         unsigned char **jpeg_buf, long *jpeg_len, int grow,
+                         int quality, int itype, int ctype,
+                         int width, int height, unsigned char *raw0,
+                         unsigned char *raw1, unsigned char *raw2);
 static void jpeg_skip_ff (j_decompress_ptr cinfo);
 
+typedef struct {
+   long sof;        /* offsets of the SOF0/1, first DQT, first DHT, */
+   long dqt;        /* DRI and SOS markers within the image          */
+   long dht;
+   long dri;
+   long sos;
+   long data;       /* first byte of entropy coded data              */
+   long sof_prog;   /* SOF2, apart from sof as only jpeg2yuv_probe
+                       deals with progressive images                */
+} jpeg_header_t;
+
+static int jpeg_scan_header (const unsigned char *jpegdata, long jpeglen,
+                             jpeg_header_t *hdr);
+
 /*******************************************************************
  *                                                                 *
  *    The following routines define a JPEG Source manager which    *
@@ -176,6 +204,134 @@ jpeg_skip_ff (j_decompress_ptr cinfo)
 }
 
 
+/*
+ * jpeg_scan_header walks the marker segments of one image up to its
+ * first SOS and notes where the interesting ones are (0 = not present).
+ * It is a reentrant cousin of scan_jpeg() in lav_io.c and never looks
+ * at the entropy coded data.
+ */
+
+#define M_SOF0  0xC0
+#define M_SOF1  0xC1
+#define M_SOF2  0xC2
+#define M_DHT   0xC4
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_DRI   0xDD
+
+static int jpeg_scan_header (const unsigned char *jpegdata, long jpeglen,
+                             jpeg_header_t *hdr)
+{
+   int  marker, length;
+   long p;
+
+   memset (hdr, 0, sizeof (*hdr));
+
+   if (jpeglen < 4 || jpegdata[0] != 0xFF || jpegdata[1] != M_SOI)
+      return -1;
+
+   p = 2;
+   while (p < jpeglen - 3) {
+      if (jpegdata[p] != 0xFF) {
+         p++;
+         continue;
+      }
+      while (p < jpeglen - 3 && jpegdata[p] == 0xFF)
+         p++;
+      marker = jpegdata[p++];
+      length = jpegdata[p] * 256 + jpegdata[p + 1];
+
+      switch (marker) {
+      case M_SOF0:
+      case M_SOF1:
+         hdr->sof = p - 2;
+         break;
+      case M_SOF2:
+         hdr->sof_prog = p - 2;
+         break;
+      case M_DQT:
+         if (hdr->dqt == 0) hdr->dqt = p - 2;
+         break;
+      case M_DHT:
+         if (hdr->dht == 0) hdr->dht = p - 2;
+         break;
+      case M_DRI:
+         hdr->dri = p - 2;
+         break;
+      case M_SOS:
+         hdr->sos = p - 2;
+         hdr->data = p + length;
+         return 0;
+      case M_EOI:
+         return -1;
+      }
+      /* TEM and RSTn carry no length */
+      if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+         continue;
+      p += length;
+   }
+   return -1;
+}
+
+/*
+ * Offset of the SOI of the image following the one whose entropy coded
+ * data starts at offset data (from jpeg_scan_header), -1 if none.
+ */
+
+static long jpeg_next_image (const unsigned char *jpegdata, long jpeglen,
+                             long data)
+{
+   const unsigned char *ff;
+   long p;
+
+   for (p = data; p < jpeglen - 1; p++) {
+      ff = memchr (jpegdata + p, 0xFF, jpeglen - 1 - p);
+      if (ff == NULL)
+         return -1;
+      p = ff - jpegdata;
+      if (jpegdata[p + 1] == M_EOI)
+         break;
+   }
+   /* skip the EOI and any fill bytes */
+   for (p += 2; p < jpeglen - 1; p++)
+      if (jpegdata[p] == 0xFF && jpegdata[p + 1] == M_SOI)
+         return p;
+   return -1;
+}
+
+int jpeg2yuv_probe (const unsigned char *jpeg_data, long len,
+                    jpeg2yuv_info_t *info)
+{
+   jpeg_header_t hdr;
+   const unsigned char *sof;
+   long at;
+   int ci;
+
+   memset (info, 0, sizeof (*info));
+   if (jpeg_scan_header (jpeg_data, len, &hdr) < 0)
+      return -1;
+   at = hdr.sof ? hdr.sof : hdr.sof_prog;
+   if (at == 0 || at + 10 > len)
+      return -1;
+
+   /* SOF: length, P, Y, X, Nf, then Ci, HiVi, Tqi per component */
+   sof = jpeg_data + at + 2;
+   info->height = sof[3] << 8 | sof[4];
+   info->width = sof[5] << 8 | sof[6];
+   info->components = sof[7];
+   info->progressive = hdr.sof == 0;
+   if (at + 10 + 3 * info->components > len)
+      return -1;
+   for (ci = 0; ci < info->components && ci < 3; ci++) {
+      info->h_samp[ci] = sof[9 + 3 * ci] >> 4;
+      info->v_samp[ci] = sof[9 + 3 * ci] & 15;
+   }
+   return 0;
+}
+
+
 /*******************************************************************
  *                                                                 *
  *    The following routines define a JPEG Destination manager     *
@@ -185,6 +341,20 @@ jpeg_skip_ff (j_decompress_ptr cinfo)
  *******************************************************************/
 
 
+/*
+ * Our destination object: a fixed buffer, or one that grows with
+ * realloc() when buf is set.  Either way the image is start[0] to
+ * start[len - free_in_buffer - 1].
+ */
+
+typedef struct {
+   struct jpeg_destination_mgr pub;
+   JOCTET *start;               /* buffer being written */
+   long len;                    /* its size */
+   unsigned char **buf;         /* the caller's pointer to it and size, */
+   long *size;                  /* updated as it grows; NULL if fixed */
+} mem_destination_mgr;
+
 /*
  * Initialize destination --- called by jpeg_start_compress
  * before any data is actually written.
@@ -199,16 +369,31 @@ static void init_destination (j_compress_ptr cinfo)
 /*
  * Empty the output buffer --- called whenever buffer fills up.
  *
- * Should never be called since all data should be written to the buffer.
- * If it gets called, the given jpeg buffer was too small.
+ * A growing buffer is doubled, and libjpeg carries on behind what it
+ * has written so far.  A fixed one should never fill up; if it does,
+ * the given jpeg buffer was too small.
  *
  */
 
 static boolean empty_output_buffer (j_compress_ptr cinfo)
 {
-   /*FIXME: */
-   mjpeg_error( "Given jpeg buffer was too small!");
-   ERREXIT (cinfo, JERR_BUFFER_SIZE);	/* shouldn't be FILE_WRITE but BUFFER_OVERRUN! */
+   mem_destination_mgr *dest = (mem_destination_mgr *) cinfo->dest;
+   long used = dest->len;
+
+   if (dest->buf == NULL) {
+      /*FIXME: */
+      mjpeg_error( "Given jpeg buffer was too small!");
+      ERREXIT (cinfo, JERR_BUFFER_SIZE);	/* shouldn't be FILE_WRITE but BUFFER_OVERRUN! */
+      return TRUE;
+   }
+
+   if (grow_buffer ((void **) dest->buf, dest->size,
+                    used > 4096 ? 2 * used : 8192) < 0)
+      ERREXIT1 (cinfo, JERR_OUT_OF_MEMORY, 0);
+   dest->start = *dest->buf;
+   dest->len = *dest->size;
+   dest->pub.next_output_byte = dest->start + used;
+   dest->pub.free_in_buffer = dest->len - used;
    return TRUE;
 }
 
@@ -244,18 +429,40 @@ jpeg_buffer_dest (j_compress_ptr cinfo, unsigned char *buf, long len)
     * manager serially with the same JPEG object, because their private object
     * sizes may be different.  Caveat programmer.
     */
+   mem_destination_mgr *dest;
+
    if (cinfo->dest == NULL) {   /* first time for this JPEG object? */
       cinfo->dest = (struct jpeg_destination_mgr *)
           (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
-                                      sizeof (struct
-                                              jpeg_destination_mgr));
+                                      sizeof (mem_destination_mgr));
    }
 
-   cinfo->dest->init_destination = init_destination;
-   cinfo->dest->empty_output_buffer = empty_output_buffer;
-   cinfo->dest->term_destination = term_destination;
-   cinfo->dest->free_in_buffer = len;
-   cinfo->dest->next_output_byte = (JOCTET *) buf;
+   dest = (mem_destination_mgr *) cinfo->dest;
+   dest->pub.init_destination = init_destination;
+   dest->pub.empty_output_buffer = empty_output_buffer;
+   dest->pub.term_destination = term_destination;
+   dest->pub.free_in_buffer = len;
+   dest->pub.next_output_byte = (JOCTET *) buf;
+   dest->start = (JOCTET *) buf;
+   dest->len = len;
+   dest->buf = NULL;
+   dest->size = NULL;
+}
+
+/*
+ * The same for a malloc()ed *buf of *len bytes, which is grown as
+ * needed; *buf and *len follow it.
+ */
+
+static void
+jpeg_grow_dest (j_compress_ptr cinfo, unsigned char **buf, long *len)
+{
+   mem_destination_mgr *dest;
+
+   jpeg_buffer_dest (cinfo, *buf, *len);
+   dest = (mem_destination_mgr *) cinfo->dest;
+   dest->buf = buf;
+   dest->size = len;
 }
 
 
@@ -307,14 +514,349 @@ static void my_emit_message (j_common_ptr cinfo, int msg_level)
    (myerr->original_emit_message)(cinfo, msg_level);
 }
 
-#define MAX_LUMA_WIDTH   4096
-#define MAX_CHROMA_WIDTH 2048
+#define JPEG2YUV_MAX_THREADS 16
+
+/*
+ * A buffer of the output pool: busy from encode_jpeg_raw_pool_ctx()
+ * until jpeg2yuv_decoder_release_jpeg(), after which up to POOL_KEEP
+ * of them are kept for the next frames.
+ */
+
+typedef struct {
+   unsigned char *buf;
+   long size;
+   int busy;
+} pool_buf_t;
+
+#define POOL_KEEP 4
+
+/*
+ * Decoder context: everything a single decode/encode call scribbles on.
+ * One context must only be used by one thread at a time, but any number
+ * of contexts may be used concurrently.
+ */
+
+struct jpeg2yuv_decoder {
+   /* scanline buffers, sized by reserve_rows() */
+   unsigned char *rowbuf;
+   int luma_width, chroma_width, full_width;
+   JSAMPROW buf0[16], buf1[8], buf2[8], chr1[8], chr2[8];
+   JSAMPROW full1[8], full2[8];     /* 4:4:4 chroma before halving */
+   struct my_error_mgr jerr;
+
+   /* decompressor kept alive across frames, see decoder_start() */
+   struct jpeg_decompress_struct dinfo;
+   int dinfo_created;
+   int std_huff_loaded;         /* dinfo holds the K.3 tables we injected */
+
+   /* compressor kept alive across frames, see encoder_start() */
+   struct jpeg_compress_struct cinfo;
+   int cinfo_created;
+   int cinfo_quality, cinfo_restart;    /* what its tables were made for */
+   unsigned char *enc_pad;      /* edge padded rows, see encode_rows() */
+   long enc_pad_size;
+
+   /* output buffers of encode_jpeg_raw_pool_ctx() */
+   pool_buf_t *pool;
+   long pool_size;
+   int npool;
+   long enc_hwm;                /* largest frame it has written */
+
+   /* options */
+   int studio_range;            /* store 16-235/16-240 instead of 0-255 */
+   int threads;                 /* > 1: decode bands or fields in parallel */
+   int field_sel;               /* a worker: decode only field field_sel-1 */
+   int crop_x, crop_y, crop_w, crop_h;  /* window to decode, crop_w 0: all */
+   int layout;                  /* JPEG2YUV_LAYOUT_*, of the chroma planes */
+   int pitch[3];                /* bytes per row of the planes, 0: packed */
+   int backend;                 /* JPEG2YUV_BACKEND_* */
+   int restart_rows;            /* encode: RSTn every that many MCU rows */
+   long target_size;            /* encode: bytes per frame, 0: no rate control */
+
+   int quality;                 /* of the last frame encoded */
+   int rate_quality;            /* for the next one, 0: none yet */
+
+#ifdef HAVE_TURBOJPEG
+   /* TurboJPEG decoding, see decode_turbo() */
+   tjhandle tj;
+   unsigned char *tj_buf;       /* its planes, if not the caller's */
+   long tj_buf_size;
+#endif
+
+   /* restart band decoding, see decode_bands() */
+   jpeg2yuv_decoder_t *workers[JPEG2YUV_MAX_THREADS];
+   unsigned char *band_jpeg;    /* a worker's sub-image */
+   long band_jpeg_size;
+   long *rst;                   /* offsets of the RSTn markers of a frame */
+   long rst_size;
+};
+
+/* Context behind the old non-reentrant entry points */
+static jpeg2yuv_decoder_t default_decoder;
+
+jpeg2yuv_decoder_t *jpeg2yuv_decoder_create (void)
+{
+   return (jpeg2yuv_decoder_t *) calloc (1, sizeof (jpeg2yuv_decoder_t));
+}
+
+void jpeg2yuv_decoder_destroy (jpeg2yuv_decoder_t *dec)
+{
+   int i;
+
+   for (i = 0; i < JPEG2YUV_MAX_THREADS; i++)
+      if (dec->workers[i] != NULL)
+         jpeg2yuv_decoder_destroy (dec->workers[i]);
+   if (dec->dinfo_created)
+      jpeg_destroy_decompress (&dec->dinfo);
+   if (dec->cinfo_created)
+      jpeg_destroy_compress (&dec->cinfo);
+#ifdef HAVE_TURBOJPEG
+   if (dec->tj != NULL)
+      tjDestroy (dec->tj);
+   free (dec->tj_buf);
+#endif
+   free (dec->rowbuf);
+   free (dec->band_jpeg);
+   free (dec->rst);
+   free (dec->enc_pad);
+   for (i = 0; i < dec->npool; i++)
+      free (dec->pool[i].buf);
+   free (dec->pool);
+   free (dec);
+}
+
+void jpeg2yuv_decoder_set_studio_range (jpeg2yuv_decoder_t *dec, int on)
+{
+   dec->studio_range = on;
+}
+
+int jpeg2yuv_decoder_set_threads (jpeg2yuv_decoder_t *dec, int threads)
+{
+   int i;
+
+   if (threads < 1)
+      threads = 1;
+   if (threads > JPEG2YUV_MAX_THREADS)
+      threads = JPEG2YUV_MAX_THREADS;
+
+   /* one worker context per band, band 0 included */
+   for (i = 0; threads > 1 && i < threads; i++)
+      if (dec->workers[i] == NULL &&
+          (dec->workers[i] = jpeg2yuv_decoder_create ()) == NULL)
+         return -1;
+
+   dec->threads = threads;
+   return 0;
+}
+
+void jpeg2yuv_decoder_set_layout (jpeg2yuv_decoder_t *dec, int layout)
+{
+   dec->layout = layout;
+}
+
+int jpeg2yuv_decoder_set_backend (jpeg2yuv_decoder_t *dec, int backend)
+{
+#ifndef HAVE_TURBOJPEG
+   if (backend == JPEG2YUV_BACKEND_TURBOJPEG)
+      return -1;
+#endif
+   dec->backend = backend;
+   return 0;
+}
+
+void jpeg2yuv_decoder_set_pitch (jpeg2yuv_decoder_t *dec,
+                                 int pitch0, int pitch1, int pitch2)
+{
+   dec->pitch[0] = pitch0 > 0 ? pitch0 : 0;
+   dec->pitch[1] = pitch1 > 0 ? pitch1 : 0;
+   dec->pitch[2] = pitch2 > 0 ? pitch2 : 0;
+}
+
+void jpeg2yuv_decoder_set_crop (jpeg2yuv_decoder_t *dec,
+                                int x, int y, int w, int h)
+{
+   if (x < 0 || y < 0 || w <= 0 || h <= 0)
+      x = y = w = h = 0;
+   dec->crop_x = x & ~1;
+   dec->crop_y = y & ~1;
+   dec->crop_w = w;
+   dec->crop_h = h;
+}
+
+void jpeg2yuv_decoder_set_target_size (jpeg2yuv_decoder_t *dec, long bytes)
+{
+   dec->target_size = bytes > 0 ? bytes : 0;
+   dec->rate_quality = 0;
+}
+
+int jpeg2yuv_decoder_get_quality (jpeg2yuv_decoder_t *dec)
+{
+   return dec->quality;
+}
+
+/*
+ * Make the scanline buffers hold at least luma_width samples per luma
+ * row, chroma_width per chroma row and full_width per row of 4:4:4
+ * chroma that is still to be halved.  All rows start on a 32 byte
+ * boundary.  They only grow, so a stream of frames of one size
+ * allocates once.  Returns -1 if out of memory.
+ */
+
+static int reserve_rows (jpeg2yuv_decoder_t *dec,
+                         int luma_width, int chroma_width, int full_width)
+{
+   unsigned char *buf, *p;
+   int i;
+
+   if (luma_width <= dec->luma_width && chroma_width <= dec->chroma_width &&
+       full_width <= dec->full_width)
+      return 0;
+
+   if (luma_width < dec->luma_width)
+      luma_width = dec->luma_width;
+   if (chroma_width < dec->chroma_width)
+      chroma_width = dec->chroma_width;
+   if (full_width < dec->full_width)
+      full_width = dec->full_width;
+   luma_width = (luma_width + 31) & ~31;
+   chroma_width = (chroma_width + 31) & ~31;
+   full_width = (full_width + 31) & ~31;
+
+   buf = calloc (16 * luma_width + 32 * chroma_width + 16 * full_width + 31,
+                 1);
+   if (buf == NULL)
+      return -1;
+   free (dec->rowbuf);
+   dec->rowbuf = buf;
+   dec->luma_width = luma_width;
+   dec->chroma_width = chroma_width;
+   dec->full_width = full_width;
+
+   p = (unsigned char *) (((size_t) buf + 31) & ~(size_t) 31);
+   for (i = 0; i < 16; i++, p += luma_width)
+      dec->buf0[i] = p;
+   for (i = 0; i < 8; i++, p += 4 * chroma_width) {
+      dec->buf1[i] = p;
+      dec->buf2[i] = p + chroma_width;
+      dec->chr1[i] = p + 2 * chroma_width;
+      dec->chr2[i] = p + 3 * chroma_width;
+   }
+   for (i = 0; i < 8; i++, p += 2 * full_width) {
+      dec->full1[i] = p;
+      dec->full2[i] = p + full_width;
+   }
+   return 0;
+}
+
+/* row store used when no range mapping is requested */
+
+static void copy_row (uint8_t *dst, const uint8_t *src, int n)
+{
+   memcpy (dst, src, n);
+}
+
+/*
+ * Row pitches of the caller's planes for a luma width and chroma width
+ * cw, see jpeg2yuv_decoder_set_pitch()
+ */
+
+static void plane_pitches (jpeg2yuv_decoder_t *dec, int width, int cw,
+                           long pitch[3])
+{
+   if (dec->layout == JPEG2YUV_LAYOUT_NV12 ||
+       dec->layout == JPEG2YUV_LAYOUT_NV21)
+      cw *= 2;
+   pitch[0] = dec->pitch[0] ? dec->pitch[0] : width;
+   pitch[1] = dec->pitch[1] ? dec->pitch[1] : cw;
+   pitch[2] = dec->pitch[2] ? dec->pitch[2] : cw;
+}
+
+/*
+ * Where decoded chroma rows go: two planes of cw samples per row, or
+ * for NV12/NV21 one plane of 2 * cw interleaved samples per row.
+ */
+
+typedef struct {
+   unsigned char *raw1, *raw2;
+   long pitch1, pitch2;
+   int cw, semi, swap, studio;
+} chroma_out_t;
+
+static void chroma_out_init (chroma_out_t *co, jpeg2yuv_decoder_t *dec,
+                             unsigned char *raw1, unsigned char *raw2,
+                             const long pitch[3], int cw)
+{
+   co->semi = dec->layout == JPEG2YUV_LAYOUT_NV12 ||
+              dec->layout == JPEG2YUV_LAYOUT_NV21;
+   co->swap = dec->layout == JPEG2YUV_LAYOUT_YV12 ||
+              dec->layout == JPEG2YUV_LAYOUT_NV21;
+   co->raw1 = co->swap && !co->semi ? raw2 : raw1;
+   co->raw2 = co->swap && !co->semi ? raw1 : raw2;
+   co->pitch1 = co->swap && !co->semi ? pitch[2] : pitch[1];
+   co->pitch2 = co->swap && !co->semi ? pitch[1] : pitch[2];
+   co->cw = cw;
+   co->studio = dec->studio_range;
+}
+
+/* Store row yc of Cb and Cr */
+
+static void store_chroma (const chroma_out_t *co, int yc,
+                          const uint8_t *cb, const uint8_t *cr)
+{
+   uint8_t *d1 = co->raw1 + yc * co->pitch1, *d2;
+
+   if (co->semi) {
+      if (co->swap)
+         yuv_zip (d1, cr, cb, co->cw);
+      else
+         yuv_zip (d1, cb, cr, co->cw);
+      if (co->studio)
+         yuv_range_chroma (d1, d1, 2 * co->cw);
+      return;
+   }
+
+   d2 = co->raw2 + yc * co->pitch2;
+   if (co->studio) {
+      yuv_range_chroma (d1, cb, co->cw);
+      yuv_range_chroma (d2, cr, co->cw);
+   } else {
+      memcpy (d1, cb, co->cw);
+      memcpy (d2, cr, co->cw);
+   }
+}
+
+/*
+ * Subsampling of the chroma planes for a Y4M_CHROMA_* mode: luma
+ * samples per chroma sample horizontally (*hr) and vertically (*vr).
+ * Both are 0 for Y4M_CHROMA_MONO, which has no chroma planes.  Modes
+ * other than 4:4:4, 4:2:2, 4:1:1 and mono are taken as 4:2:0.
+ */
 
-static unsigned char buf0[16][MAX_LUMA_WIDTH];
-static unsigned char buf1[8][MAX_CHROMA_WIDTH];
-static unsigned char buf2[8][MAX_CHROMA_WIDTH];
-static unsigned char chr1[8][MAX_CHROMA_WIDTH];
-static unsigned char chr2[8][MAX_CHROMA_WIDTH];
+static void chroma_ratios (int ctype, int *hr, int *vr)
+{
+   switch (ctype) {
+   case Y4M_CHROMA_444:
+      *hr = 1;
+      *vr = 1;
+      break;
+   case Y4M_CHROMA_422:
+      *hr = 2;
+      *vr = 1;
+      break;
+   case Y4M_CHROMA_411:
+      *hr = 4;
+      *vr = 1;
+      break;
+   case Y4M_CHROMA_MONO:
+      *hr = 0;
+      *vr = 0;
+      break;
+   default:
+      *hr = 2;
+      *vr = 2;
+      break;
+   }
+}
 
 
 
@@ -348,70 +890,73 @@ static void add_huff_table (j_decompress_ptr dinfo,
 
 
 
-static void std_huff_tables (j_decompress_ptr dinfo)
-/* Set up the standard Huffman tables (cf. JPEG standard section K.3) */
+/* The standard Huffman tables (cf. JPEG standard section K.3) */
 /* IMPORTANT: these are only valid for 8-bit data precision! */
+
+static const UINT8 bits_dc_luminance[17] =
+  { /* 0-base */ 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const UINT8 val_dc_luminance[] =
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const UINT8 bits_dc_chrominance[17] =
+  { /* 0-base */ 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const UINT8 val_dc_chrominance[] =
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const UINT8 bits_ac_luminance[17] =
+  { /* 0-base */ 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const UINT8 val_ac_luminance[] =
+  { 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+    0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa };
+
+static const UINT8 bits_ac_chrominance[17] =
+  { /* 0-base */ 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const UINT8 val_ac_chrominance[] =
+  { 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+    0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa };
+
+
+static void std_huff_tables (j_decompress_ptr dinfo)
+/* Set up the standard Huffman tables */
 {
-  static const UINT8 bits_dc_luminance[17] =
-    { /* 0-base */ 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
-  static const UINT8 val_dc_luminance[] =
-    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
-  
-  static const UINT8 bits_dc_chrominance[17] =
-    { /* 0-base */ 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
-  static const UINT8 val_dc_chrominance[] =
-    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
-  
-  static const UINT8 bits_ac_luminance[17] =
-    { /* 0-base */ 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
-  static const UINT8 val_ac_luminance[] =
-    { 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
-      0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
-      0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
-      0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
-      0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
-      0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
-      0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
-      0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
-      0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
-      0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
-      0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
-      0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
-      0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
-      0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
-      0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
-      0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
-      0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
-      0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
-      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
-      0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
-      0xf9, 0xfa };
-  
-  static const UINT8 bits_ac_chrominance[17] =
-    { /* 0-base */ 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
-  static const UINT8 val_ac_chrominance[] =
-    { 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
-      0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
-      0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
-      0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
-      0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
-      0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
-      0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
-      0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
-      0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
-      0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
-      0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
-      0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
-      0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
-      0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
-      0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
-      0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
-      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
-      0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
-      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
-      0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
-      0xf9, 0xfa };
-  
   add_huff_table(dinfo, &dinfo->dc_huff_tbl_ptrs[0],
 		 bits_dc_luminance, val_dc_luminance);
   add_huff_table(dinfo, &dinfo->ac_huff_tbl_ptrs[0],
@@ -423,15 +968,55 @@ static void std_huff_tables (j_decompress_ptr dinfo)
 }
 
 
+static int huff_table_is (const JHUFF_TBL *tbl,
+			  const UINT8 *bits, const UINT8 *val)
+{
+  int nsymbols = 0, len;
+
+  if (tbl == NULL || memcmp(tbl->bits, bits, 17) != 0)
+    return 0;
+  for (len = 1; len <= 16; len++)
+    nsymbols += bits[len];
+  return memcmp(tbl->huffval, val, nsymbols) == 0;
+}
+
+/*
+ * Many capture cards store the standard tables in a DHT of their own.
+ * Check whether the slots std_huff_tables() fills hold exactly that
+ * set after such a DHT was read.  If so, the next DHT-less frame needs
+ * nothing copied in.
+ */
+
+static int std_huff_tables_present (j_decompress_ptr dinfo)
+{
+  return huff_table_is(dinfo->dc_huff_tbl_ptrs[0],
+		       bits_dc_luminance, val_dc_luminance) &&
+         huff_table_is(dinfo->ac_huff_tbl_ptrs[0],
+		       bits_ac_luminance, val_ac_luminance) &&
+         huff_table_is(dinfo->dc_huff_tbl_ptrs[1],
+		       bits_dc_chrominance, val_dc_chrominance) &&
+         huff_table_is(dinfo->ac_huff_tbl_ptrs[1],
+		       bits_ac_chrominance, val_ac_chrominance);
+}
+
+
+
+/*
+ * The decompressor lives across frames, so the table slots are never
+ * NULL after the first image.  Whether a frame brought its own tables
+ * is therefore decided from its header (has_dht) instead, and the
+ * standard set is only copied in again when something else replaced it
+ * (the caller clears std_huff_loaded whenever a DHT is about to be read,
+ * and sets it again if that DHT turns out to hold the standard set).
+ */
 
-static void guarantee_huff_tables(j_decompress_ptr dinfo)
+static void guarantee_huff_tables(jpeg2yuv_decoder_t *dec,
+				  j_decompress_ptr dinfo, int has_dht)
 {
-  if ( (dinfo->dc_huff_tbl_ptrs[0] == NULL) &&
-       (dinfo->dc_huff_tbl_ptrs[1] == NULL) &&
-       (dinfo->ac_huff_tbl_ptrs[0] == NULL) &&
-       (dinfo->ac_huff_tbl_ptrs[1] == NULL) ) {
+  if (!has_dht && !dec->std_huff_loaded) {
     mjpeg_debug( "Generating standard Huffman tables for this frame.");
     std_huff_tables(dinfo);
+    dec->std_huff_loaded = 1;
   }
 }
 
@@ -441,169 +1026,880 @@ static void guarantee_huff_tables(j_decompress_ptr dinfo)
 
 
 /*
- * jpeg_data:       Buffer with jpeg data to decode
- * len:             Length of buffer
- * itype:           0: Not interlaced
- *                  1: Interlaced, Top field first
- *                  2: Interlaced, Bottom field first
- * ctype            Chroma format for decompression.
- *                  Currently only Y4M_CHROMA_{420JPEG,422} are available
- * returns:
- *	-1 on fatal error
- *	0 on success
- *	1 if jpeg lib threw a "corrupt jpeg data" warning.  
- *		in this case, "a damaged output image is likely."
- *	
+ * Create the context's decompressor on first use; later frames only
+ * reset it.  Must be called after the setjmp() of the caller.
  */
 
-int decode_jpeg_raw (unsigned char *jpeg_data, int len,
-                     int itype, int ctype, int width, int height,
-                     unsigned char *raw0, unsigned char *raw1,
-                     unsigned char *raw2)
+static void decoder_start (jpeg2yuv_decoder_t *dec)
 {
-   int numfields, hsf[3], vsf[3], field, yl, yc, x, y = 0, i, xsl, xsc, xs, xd,
-       hdown;
-
-   JSAMPROW row0[16] = { buf0[0], buf0[1], buf0[2], buf0[3],
-      buf0[4], buf0[5], buf0[6], buf0[7],
-      buf0[8], buf0[9], buf0[10], buf0[11],
-      buf0[12], buf0[13], buf0[14], buf0[15]
-   };
-   JSAMPROW row1[8] = { buf1[0], buf1[1], buf1[2], buf1[3],
-			buf1[4], buf1[5], buf1[6], buf1[7]   };
-   JSAMPROW row2[16] = { buf2[0], buf2[1], buf2[2], buf2[3],
-			 buf2[4], buf2[5], buf2[6], buf2[7]  };
-   JSAMPROW row1_444[16], row2_444[16];
-   JSAMPARRAY scanarray[3] = { row0, row1, row2 };
-   struct jpeg_decompress_struct dinfo;
-   struct my_error_mgr jerr;
-
-   /* We set up the normal JPEG error routines, then override error_exit. */
-   dinfo.err = jpeg_std_error (&jerr.pub);
-   jerr.pub.error_exit = my_error_exit;
-   /* also hook the emit_message routine to note corrupt-data warnings */
-   jerr.original_emit_message = jerr.pub.emit_message;
-   jerr.pub.emit_message = my_emit_message;
-   jerr.warning_seen = 0;
+   if (!dec->dinfo_created) {
+      yuv_resample_init ();
+      jpeg_create_decompress (&dec->dinfo);
+      dec->dinfo_created = 1;
+   } else
+      jpeg_abort_decompress (&dec->dinfo);
+}
 
-   /* Establish the setjmp return context for my_error_exit to use. */
-   if (setjmp (jerr.setjmp_buffer)) {
-      /* If we get here, the JPEG code has signaled an error. */
-      jpeg_destroy_decompress (&dinfo);
-      return -1;
-   }
+static void decoder_abort (jpeg2yuv_decoder_t *dec)
+{
+   if (dec->dinfo_created)
+      jpeg_abort_decompress (&dec->dinfo);
+}
 
-   jpeg_create_decompress (&dinfo);
+/*
+ * libjpeg can decode at 1/2, 1/4 or 1/8 size straight from the DCT
+ * coefficients, which is far cheaper than decoding everything and
+ * averaging samples away afterwards.  There is no vertical resampler,
+ * so a reduced size is only used when the full size height does not
+ * fit the request but a reduced one does, and its width still covers
+ * the requested width; the horizontal resampling then does the rest.
+ * As for the full size, a whole frame is preferred over one field of
+ * a pair, and then the smallest size is taken.
+ *
+ * Every iMCU row must deliver an even number of chroma rows for 4:2:0
+ * output, hence the check on the last component's DCT size.
+ *
+ * Must be called after jpeg_read_header, which resets the scaling.
+ * Returns the denominator.
+ */
 
-   jpeg_buffer_src (&dinfo, jpeg_data, len);
+static int choose_idct_scale (j_decompress_ptr dinfo, int width, int height)
+{
+   int fields, denom;
+
+   dinfo->scale_num = 1;
+   dinfo->scale_denom = 1;
+   if ((int) dinfo->image_height == height ||
+       2 * (int) dinfo->image_height == height)
+      return 1;
+
+   for (fields = 1; fields <= 2; fields++)
+      for (denom = 8; denom > 1; denom /= 2) {
+         dinfo->scale_denom = denom;
+         jpeg_calc_output_dimensions (dinfo);
+         if (fields * (int) dinfo->output_height == height &&
+             (int) dinfo->output_width >= width &&
+             dinfo->comp_info[dinfo->num_components - 1].DCT_scaled_size >= 2)
+            return denom;
+      }
 
-   /* Read header, make some checks and try to figure out what the
-      user really wants */
+   dinfo->scale_denom = 1;
+   return 1;
+}
 
-   jpeg_read_header (&dinfo, TRUE);
-   dinfo.raw_data_out = TRUE;
-   dinfo.do_fancy_upsampling = FALSE;
-   dinfo.out_color_space = JCS_YCbCr;
-   dinfo.dct_method = JDCT_IFAST;
-   guarantee_huff_tables(&dinfo);
-   jpeg_start_decompress (&dinfo);
 
-   if (dinfo.output_components != 3) {
-      mjpeg_error( "Output components of JPEG image = %d, must be 3",
-               dinfo.output_components);
-      goto ERR_EXIT;
-   }
+/*******************************************************************
+ *                                                                 *
+ *    Parallel decoding of restart interval bands                  *
+ *                                                                 *
+ *******************************************************************/
 
-   for (i = 0; i < 3; i++) {
-      hsf[i] = dinfo.comp_info[i].h_samp_factor;
-      vsf[i] = dinfo.comp_info[i].v_samp_factor;
-   }
+/*
+ * When the restart interval is a whole number of MCU rows, each RSTn
+ * marker starts a new row of MCUs with fresh DC predictors, so the
+ * entropy data between two markers can be decoded without the rest.
+ * A frame is cut into up to dec->threads bands of such segments, and
+ * every band is turned into a JPEG of its own: the original headers
+ * with the SOF height patched, the band's data with the RSTn markers
+ * renumbered from RST0, and an EOI.  The bands are decoded by the
+ * worker contexts, one thread each, straight into their rows of the
+ * output planes.
+ *
+ * Only single, full size, interleaved baseline frames are split.
+ * Everything else makes decode_bands() return DECODE_SERIAL and the
+ * caller decodes the frame as usual.
+ */
 
-   //mjpeg_info( "Sampling factors, hsf=(%d, %d, %d) vsf=(%d, %d, %d) !", hsf[0], hsf[1], hsf[2], vsf[0], vsf[1], vsf[2]);
-   if ((hsf[0] != 2 && hsf[0] != 1) || hsf[1] != 1 || hsf[2] != 1 ||
-       (vsf[0] != 1 && vsf[0] != 2) || vsf[1] != 1 || vsf[2] != 1) {
-      mjpeg_error( "Unsupported sampling factors, hsf=(%d, %d, %d) vsf=(%d, %d, %d) !", hsf[0], hsf[1], hsf[2], vsf[0], vsf[1], vsf[2]);
-      goto ERR_EXIT;
-   }
+#define DECODE_SERIAL (-2)
 
-   if (hsf[0] == 1)
-     {
-       if (height % 8 != 0)
-	 {
-	   mjpeg_error( "YUV 4:4:4 sampling, but image height %d not dividable by 8 !\n", height);
-	   goto ERR_EXIT;	   
-	 }
+typedef struct {
+   jpeg2yuv_decoder_t *dec;     /* worker context */
+   unsigned char *jpeg;
+   long len;
+   int gray, itype, ctype, width, height;
+   unsigned char *raw0, *raw1, *raw2;
+   int encode, quality;         /* a band of encode_bands(), written to
+                                   the worker's band_jpeg */
+   int result;
+} decode_job_t;
 
-       mjpeg_info("YUV 4:4:4 sampling encountered ! Allocating special row buffer\n");
-       for (y = 0; y < 16; y++) // allocate a special buffer for the extra sampling depth
-	 {
-	   //mjpeg_info("YUV 4:4:4 %d.\n",y);
-	   row1_444[y] = (unsigned char *)malloc(dinfo.output_width * sizeof(char));
-	   row2_444[y] = (unsigned char *)malloc(dinfo.output_width * sizeof(char));
-	 }
-       //mjpeg_info("YUV 4:4:4 sampling encountered ! Allocating done.\n");
-       scanarray[1] = row1_444; 
-       scanarray[2] = row2_444; 
-     }
+static void *decode_worker (void *arg)
+{
+   decode_job_t *job = (decode_job_t *) arg;
+
+   if (job->encode)
+      job->result = encode_frame (job->dec, &job->dec->band_jpeg,
+                                  &job->dec->band_jpeg_size, 1,
+                                  job->quality, job->itype, job->ctype,
+                                  job->width, job->height,
+                                  job->raw0, job->raw1, job->raw2);
+   else if (job->gray)
+      job->result = decode_jpeg_gray_raw_ctx (job->dec, job->jpeg, job->len,
+                                              job->itype, job->ctype,
+                                              job->width, job->height,
+                                              job->raw0, job->raw1, job->raw2);
+   else
+      job->result = decode_jpeg_raw_ctx (job->dec, job->jpeg, job->len,
+                                         job->itype, job->ctype,
+                                         job->width, job->height,
+                                         job->raw0, job->raw1, job->raw2);
+   return NULL;
+}
 
-   /* Height match image height or be exact twice the image height */
+/*
+ * Run the first njobs jobs, job 0 on the calling thread.  Returns -1 if
+ * any failed, else the largest result: for decoding 1 if any saw
+ * corrupt data, else 0.
+ */
 
-   if (dinfo.output_height == height) {
-      numfields = 1;
-   } else if (2 * dinfo.output_height == height) {
-      numfields = 2;
-   } else {
-      mjpeg_error(
-               "Read JPEG: requested height = %d, height of image = %d",
-               height, dinfo.output_height);
-      goto ERR_EXIT;
+static int run_jobs (decode_job_t *job, int njobs)
+{
+   pthread_t tid[JPEG2YUV_MAX_THREADS];
+   int started[JPEG2YUV_MAX_THREADS];
+   int i, result;
+
+   for (i = 1; i < njobs; i++)
+      started[i] = pthread_create (&tid[i], NULL, decode_worker, &job[i]) == 0;
+   decode_worker (&job[0]);
+   for (i = 1; i < njobs; i++) {
+      if (started[i])
+         pthread_join (tid[i], NULL);
+      else
+         decode_worker (&job[i]);
    }
 
-   /* Width is more flexible */
+   result = 0;
+   for (i = 0; i < njobs; i++) {
+      if (job[i].result < 0)
+         return -1;
+      if (job[i].result > result)
+         result = job[i].result;
+   }
+   return result;
+}
+
+static int grow_buffer (void **buf, long *size, long need)
+{
+   void *p;
+
+   if (need <= *size)
+      return 0;
+   p = realloc (*buf, need);
+   if (p == NULL)
+      return -1;
+   *buf = p;
+   *size = need;
+   return 0;
+}
+
+/*
+ * Where the restart segments of a frame are: filled in by
+ * map_restarts(), the offsets of the RSTn markers go to dec->rst.
+ */
+
+typedef struct {
+   jpeg_header_t hdr;
+   int height;                  /* of the image, from SOF */
+   int seg_h;                   /* luma rows per restart segment */
+   int nsegs;
+   long end;                    /* end of the entropy coded data */
+} restart_map_t;
+
+/*
+ * Returns 0 if the frame in jpeg_data (nf components) is a single
+ * interleaved baseline scan with a restart interval of whole MCU rows
+ * and at least two segments, else -1.
+ */
+
+static int map_restarts (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len, int nf,
+                         restart_map_t *map)
+{
+   jpeg_header_t *hdr = &map->hdr;
+   const unsigned char *sof, *sos;
+   int ci, hmax, vmax, mcu_w, mcu_h, mcu_rows, mcus_per_row, ri, seg_rows;
+   long p, nrst;
+
+   if (jpeg_scan_header (jpeg_data, len, hdr) < 0 ||
+       hdr->sof == 0 || hdr->dri == 0)
+      return -1;
+
+   /* SOF: P, Y, X, Nf, then Ci, HiVi, Tqi per component */
+   sof = jpeg_data + hdr->sof + 4;
+   if (sof[5] != nf)
+      return -1;
+   map->height = sof[1] << 8 | sof[2];
+   hmax = vmax = 1;
+   for (ci = 0; ci < nf; ci++) {
+      if (sof[7 + 3 * ci] >> 4 > hmax)
+         hmax = sof[7 + 3 * ci] >> 4;
+      if ((sof[7 + 3 * ci] & 15) > vmax)
+         vmax = sof[7 + 3 * ci] & 15;
+   }
+   if (nf == 1)                 /* non-interleaved: an MCU is one block */
+      hmax = vmax = 1;
+   mcu_w = 8 * hmax;
+   mcu_h = 8 * vmax;
+
+   /* the one scan must hold all components */
+   sos = jpeg_data + hdr->sos + 4;
+   if (sos[0] != nf)
+      return -1;
+
+   ri = jpeg_data[hdr->dri + 4] << 8 | jpeg_data[hdr->dri + 5];
+   mcus_per_row = ((sof[3] << 8 | sof[4]) + mcu_w - 1) / mcu_w;
+   if (ri == 0 || ri % mcus_per_row != 0)
+      return -1;
+   seg_rows = ri / mcus_per_row;
+   mcu_rows = (map->height + mcu_h - 1) / mcu_h;
+   map->seg_h = seg_rows * mcu_h;
+
+   /* find the RSTn markers, and the end of the entropy coded data */
+   nrst = 0;
+   map->end = len;
+   for (p = hdr->data; p < len - 1; p++) {
+      const unsigned char *ff = memchr (jpeg_data + p, 0xFF, len - 1 - p);
+
+      if (ff == NULL)
+         break;
+      p = ff - jpeg_data;
+      if (jpeg_data[p + 1] == 0x00 || jpeg_data[p + 1] == 0xFF)
+         continue;
+      if (jpeg_data[p + 1] < 0xD0 || jpeg_data[p + 1] > 0xD7) {
+         map->end = p;
+         break;
+      }
+      if (grow_buffer ((void **) &dec->rst, &dec->rst_size,
+                       (nrst + 1) * sizeof (long)) < 0)
+         return -1;
+      dec->rst[nrst++] = p;
+      p++;
+   }
+
+   map->nsegs = nrst + 1;
+   if (map->nsegs < 2 ||
+       map->nsegs != (mcu_rows + seg_rows - 1) / seg_rows)
+      return -1;
+   return 0;
+}
+
+/*
+ * Turn segments seg0 .. seg1-1 of the mapped frame into a JPEG of
+ * their own in to->band_jpeg.  Returns its length, or -1 if out of
+ * memory.
+ */
+
+static long build_band (jpeg2yuv_decoder_t *to, const long *rst,
+                        unsigned char *jpeg_data, const restart_map_t *map,
+                        int seg0, int seg1)
+{
+   long start, stop, hlen, len, k;
+   int y0, y1;
+   unsigned char *band;
+
+   hlen = map->hdr.data;
+   start = seg0 == 0 ? hlen : rst[seg0 - 1] + 2;
+   stop = seg1 == map->nsegs ? map->end : rst[seg1 - 1];
+   y0 = seg0 * map->seg_h;
+   y1 = seg1 * map->seg_h < map->height ? seg1 * map->seg_h : map->height;
+
+   len = hlen + (stop - start) + 2;
+   if (grow_buffer ((void **) &to->band_jpeg, &to->band_jpeg_size, len) < 0)
+      return -1;
+
+   band = to->band_jpeg;
+   memcpy (band, jpeg_data, hlen);
+   band[map->hdr.sof + 5] = (y1 - y0) >> 8;
+   band[map->hdr.sof + 6] = (y1 - y0) & 0xFF;
+   memcpy (band + hlen, jpeg_data + start, stop - start);
+   for (k = seg0; k < seg1 - 1; k++)
+      band[hlen + rst[k] - start + 1] = 0xD0 + ((k - seg0) & 7);
+   band[len - 2] = 0xFF;
+   band[len - 1] = M_EOI;
+   return len;
+}
+
+static int decode_bands (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len, int gray,
+                         int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2)
+{
+   restart_map_t map;
+   decode_job_t job[JPEG2YUV_MAX_THREADS];
+   int nbands, spb, b, seg0, seg1, y0, y1, yc0, hr, vr, cw;
+   long pitch[3];
+
+   chroma_ratios (ctype, &hr, &vr);
+   cw = hr ? width / hr : 0;
+   plane_pitches (dec, width, cw, pitch);
+   if (dec->threads < 2 || dec->crop_w > 0 ||
+       width % 2 != 0 || (hr && width % hr != 0) ||
+       map_restarts (dec, jpeg_data, len, gray ? 1 : 3, &map) < 0 ||
+       map.height != height)
+      return DECODE_SERIAL;
+
+   spb = (map.nsegs + dec->threads - 1) / dec->threads;
+   nbands = (map.nsegs + spb - 1) / spb;
+
+   /* build the sub-images */
+   for (b = 0; b < nbands; b++) {
+      seg0 = b * spb;
+      seg1 = seg0 + spb < map.nsegs ? seg0 + spb : map.nsegs;
+      y0 = seg0 * map.seg_h;
+      y1 = seg1 * map.seg_h < height ? seg1 * map.seg_h : height;
+
+      job[b].dec = dec->workers[b];
+      job[b].len = build_band (job[b].dec, dec->rst, jpeg_data, &map,
+                               seg0, seg1);
+      if (job[b].len < 0)
+         return DECODE_SERIAL;
+
+      /* same planes, same row pitches, starting at the band's rows */
+      yc0 = vr == 2 ? y0 / 2 : y0;
+      job[b].jpeg = job[b].dec->band_jpeg;
+      job[b].gray = gray;
+      job[b].encode = 0;
+      job[b].itype = 0;
+      job[b].ctype = ctype;
+      job[b].width = width;
+      job[b].height = y1 - y0;
+      job[b].raw0 = raw0 + y0 * pitch[0];
+      job[b].raw1 = hr && raw1 ? raw1 + yc0 * pitch[1] : NULL;
+      job[b].raw2 = hr && raw2 ? raw2 + yc0 * pitch[2] : NULL;
+      job[b].dec->studio_range = dec->studio_range;
+      job[b].dec->field_sel = 0;
+      job[b].dec->crop_w = 0;
+      job[b].dec->layout = dec->layout;
+      job[b].dec->backend = dec->backend;
+      memcpy (job[b].dec->pitch, dec->pitch, sizeof (dec->pitch));
+   }
+
+   mjpeg_debug ("Decoding %d restart bands of %d segments each", nbands, spb);
+
+   return run_jobs (job, nbands);
+}
+
+/*
+ * A crop window further down the frame need not be decoded from the
+ * top: with restart markers every few MCU rows the data can just as
+ * well start at the segment holding the window's first row, cf.
+ * decode_bands().  That sub-image is built in dec->band_jpeg and
+ * *jpeg_data, *len are pointed at it.  Returns the number of rows
+ * skipped that way.
+ */
 
-   if (dinfo.output_width > MAX_LUMA_WIDTH) {
-      mjpeg_error( "Image width of %d exceeds max",
-               dinfo.output_width);
+static int skip_to_crop (jpeg2yuv_decoder_t *dec,
+                         unsigned char **jpeg_data, int *len, int gray)
+{
+   restart_map_t map;
+   long blen;
+   int seg0;
+
+   if (map_restarts (dec, *jpeg_data, *len, gray ? 1 : 3, &map) < 0)
+      return 0;
+   seg0 = dec->crop_y / map.seg_h;
+   if (seg0 == 0 || seg0 >= map.nsegs)
+      return 0;
+   blen = build_band (dec, dec->rst, *jpeg_data, &map, seg0, map.nsegs);
+   if (blen < 0)
+      return 0;
+
+   mjpeg_debug ("Crop window: skipping %d restart segments", seg0);
+   *jpeg_data = dec->band_jpeg;
+   *len = blen;
+   return seg0 * map.seg_h;
+}
+
+/*
+ * The two images of a field pair are independent, so they can be
+ * decoded at the same time: worker 0 gets the buffer up to the second
+ * SOI and decodes only the first field, worker 1 gets the rest and
+ * decodes only the second, each into its own rows.  Both take the
+ * usual path, only the field loop is restricted by field_sel.
+ *
+ * A second field without DHT reuses the tables of the first when
+ * decoded serially, so that case stays serial if the first has a DHT.
+ */
+
+static int decode_fields (jpeg2yuv_decoder_t *dec,
+                          unsigned char *jpeg_data, int len, int gray,
+                          int itype, int ctype, int width, int height,
+                          unsigned char *raw0, unsigned char *raw1,
+                          unsigned char *raw2)
+{
+   jpeg_header_t hdr, hdr2;   /* second field: same size, own tables */
+   decode_job_t job[2];
+   long second;
+   int i;
+
+   if (dec->threads < 2 ||
+       jpeg_scan_header (jpeg_data, len, &hdr) < 0 || hdr.sof == 0 ||
+       2 * (jpeg_data[hdr.sof + 5] << 8 | jpeg_data[hdr.sof + 6]) != height)
+      return DECODE_SERIAL;
+
+   second = jpeg_next_image (jpeg_data, len, hdr.data);
+   if (second < 0 ||
+       jpeg_scan_header (jpeg_data + second, len - second, &hdr2) < 0 ||
+       hdr2.sof == 0 ||
+       memcmp (jpeg_data + hdr.sof + 5, jpeg_data + second + hdr2.sof + 5, 4) ||
+       (hdr.dht != 0 && hdr2.dht == 0))
+      return DECODE_SERIAL;
+
+   for (i = 0; i < 2; i++) {
+      job[i].dec = dec->workers[i];
+      job[i].jpeg = jpeg_data + (i ? second : 0);
+      job[i].len = i ? len - second : second;
+      job[i].gray = gray;
+      job[i].encode = 0;
+      job[i].itype = itype;
+      job[i].ctype = ctype;
+      job[i].width = width;
+      job[i].height = height;
+      job[i].raw0 = raw0;
+      job[i].raw1 = raw1;
+      job[i].raw2 = raw2;
+      job[i].dec->studio_range = dec->studio_range;
+      job[i].dec->field_sel = i + 1;
+      job[i].dec->crop_x = dec->crop_x;
+      job[i].dec->crop_y = dec->crop_y;
+      job[i].dec->crop_w = dec->crop_w;
+      job[i].dec->crop_h = dec->crop_h;
+      job[i].dec->layout = dec->layout;
+      job[i].dec->backend = dec->backend;
+      memcpy (job[i].dec->pitch, dec->pitch, sizeof (dec->pitch));
+   }
+
+   mjpeg_debug ("Decoding both fields in parallel");
+
+   return run_jobs (job, 2);
+}
+
+#ifdef HAVE_TURBOJPEG
+
+/*******************************************************************
+ *                                                                 *
+ *    TurboJPEG backend                                            *
+ *                                                                 *
+ *******************************************************************/
+
+#define TJ_PAD(v, p) (((v) + (p) - 1) & ~((p) - 1))
+
+/*
+ * With JPEG2YUV_BACKEND_TURBOJPEG, frames that need no resampling at
+ * all, i.e. a single image of the requested size with the chroma
+ * sampling of ctype (4:2:0, 4:2:2 or 4:4:4), are decoded by
+ * tjDecompressToYUV().  That writes the three planes one after the
+ * other, rows padded to 4 bytes, so it writes straight into the caller's
+ * planes if they happen to be laid out that way (as one I420 buffer of
+ * a width that is a multiple of 8 is), and into dec->tj_buf followed by
+ * a copy otherwise.  TurboJPEG uses the accurate integer IDCT, so the
+ * samples can differ slightly from those of the libjpeg path.
+ *
+ * Frames without a DHT are left to the libjpeg path, which knows how to
+ * supply the standard tables.  Returns DECODE_SERIAL for anything not
+ * handled here.
+ */
+
+static int decode_turbo (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len,
+                         int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2)
+{
+   jpeg_header_t hdr;
+   unsigned char *plane[3], *dst[3], *tmp;
+   long pitch[3], tpitch[3], size, swap;
+   int want, w, h, subsamp, hr, vr, cw, ch, i, y, n;
+
+   switch (ctype) {
+   case Y4M_CHROMA_444:
+      want = TJSAMP_444;
+      break;
+   case Y4M_CHROMA_422:
+      want = TJSAMP_422;
+      break;
+   case Y4M_CHROMA_411:
+   case Y4M_CHROMA_MONO:
+      return DECODE_SERIAL;
+   default:
+      want = TJSAMP_420;
+   }
+   chroma_ratios (ctype, &hr, &vr);
+
+   if (dec->crop_w > 0 || dec->layout == JPEG2YUV_LAYOUT_NV12 ||
+       dec->layout == JPEG2YUV_LAYOUT_NV21 ||
+       width % hr != 0 || height % vr != 0 ||
+       jpeg_scan_header (jpeg_data, len, &hdr) < 0 || hdr.dht == 0)
+      return DECODE_SERIAL;
+   if (dec->tj == NULL && (dec->tj = tjInitDecompress ()) == NULL)
+      return DECODE_SERIAL;
+   if (tjDecompressHeader2 (dec->tj, jpeg_data, len, &w, &h, &subsamp) < 0 ||
+       w != width || h != height || subsamp != want)
+      return DECODE_SERIAL;
+
+   cw = width / hr;
+   ch = height / vr;
+   tpitch[0] = TJ_PAD (width, 4);
+   tpitch[1] = tpitch[2] = TJ_PAD (cw, 4);
+
+   plane_pitches (dec, width, cw, pitch);
+   dst[0] = raw0;
+   dst[1] = dec->layout == JPEG2YUV_LAYOUT_YV12 ? raw2 : raw1;
+   dst[2] = dec->layout == JPEG2YUV_LAYOUT_YV12 ? raw1 : raw2;
+   if (dec->layout == JPEG2YUV_LAYOUT_YV12) {
+      swap = pitch[1];
+      pitch[1] = pitch[2];
+      pitch[2] = swap;
+   }
+
+   if (pitch[0] == tpitch[0] && pitch[1] == tpitch[1] &&
+       pitch[2] == tpitch[2] && dst[1] == dst[0] + tpitch[0] * height &&
+       dst[2] == dst[1] + tpitch[1] * ch)
+      tmp = dst[0];
+   else {
+      size = tpitch[0] * height + 2 * tpitch[1] * ch;
+      if (grow_buffer ((void **) &dec->tj_buf, &dec->tj_buf_size, size) < 0)
+         return DECODE_SERIAL;
+      tmp = dec->tj_buf;
+   }
+
+   if (tjDecompressToYUV (dec->tj, jpeg_data, len, tmp, 0) < 0) {
+      mjpeg_error ("TurboJPEG: %s", tjGetErrorStr ());
+      return -1;
+   }
+
+   /* copy to the caller's planes if needed, studio range on the way */
+   plane[0] = tmp;
+   plane[1] = plane[0] + tpitch[0] * height;
+   plane[2] = plane[1] + tpitch[1] * ch;
+   for (i = 0; i < 3; i++) {
+      n = i ? cw : width;
+      for (y = 0; y < (i ? ch : height); y++) {
+         unsigned char *from = plane[i] + y * tpitch[i];
+         unsigned char *to = dst[i] + y * pitch[i];
+
+         if (!dec->studio_range) {
+            if (to != from)
+               memcpy (to, from, n);
+         } else if (i == 0)
+            yuv_range_luma (to, from, n);
+         else
+            yuv_range_chroma (to, from, n);
+      }
+   }
+
+   return 0;
+}
+
+#endif /* HAVE_TURBOJPEG */
+
+/*
+ * jpeg_data:       Buffer with jpeg data to decode
+ * len:             Length of buffer
+ * itype:           0: Not interlaced
+ *                  1: Interlaced, Top field first
+ *                  2: Interlaced, Bottom field first
+ * ctype            Chroma format for decompression.
+ *                  Y4M_CHROMA_{420JPEG,422,444,411,MONO}; the JPEG
+ *                  must have that horizontal chroma subsampling,
+ *                  or 4:4:4 for 4:2:0/4:2:2.  MONO: raw1/raw2 unused
+ * returns:
+ *	-1 on fatal error
+ *	0 on success
+ *	1 if jpeg lib threw a "corrupt jpeg data" warning.  
+ *		in this case, "a damaged output image is likely."
+ *	
+ */
+
+int decode_jpeg_raw (unsigned char *jpeg_data, int len,
+                     int itype, int ctype, int width, int height,
+                     unsigned char *raw0, unsigned char *raw1,
+                     unsigned char *raw2)
+{
+   return decode_jpeg_raw_ctx (&default_decoder, jpeg_data, len, itype, ctype,
+                               width, height, raw0, raw1, raw2);
+}
+
+int decode_jpeg_raw_ctx (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len,
+                         int itype, int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2)
+{
+   int numfields, hsf[3], vsf[3], field, yl, yc, y = 0, i, xsl, xsc,
+       hdown, direct_luma, direct_chroma, denom, rows, first_field, last_field;
+   long xd;
+   int hr, vr, cw, collapse, full;
+   int crop = dec->crop_w > 0, skipped = 0, iw, ih, ys, y_lo, y_hi, y_stop;
+   int studio = dec->studio_range;
+   void (*put_luma) (uint8_t *, const uint8_t *, int) =
+      studio ? yuv_range_luma : copy_row;
+   chroma_out_t co;
+   long pitch[3];
+
+   JSAMPROW *chr1 = dec->chr1, *chr2 = dec->chr2;
+   unsigned char *c1, *c2;
+   JSAMPROW row0[16], row1[8], row2[8];
+   JSAMPROW row1_444[8], row2_444[8];
+   JSAMPROW out0[16], out1[8], out2[8];
+   JSAMPARRAY scanarray[3] = { row0, row1, row2 };
+   j_decompress_ptr dinfo = &dec->dinfo;
+   jpeg_header_t hdr;
+   struct my_error_mgr *jerr = &dec->jerr;
+
+   if (dec->threads > 1) {
+      i = decode_bands (dec, jpeg_data, len, 0, ctype, width, height,
+                        raw0, raw1, raw2);
+      if (i == DECODE_SERIAL)
+         i = decode_fields (dec, jpeg_data, len, 0, itype, ctype,
+                            width, height, raw0, raw1, raw2);
+      if (i != DECODE_SERIAL)
+         return i;
+   }
+
+#ifdef HAVE_TURBOJPEG
+   if (dec->backend == JPEG2YUV_BACKEND_TURBOJPEG && dec->field_sel == 0) {
+      yuv_resample_init ();
+      i = decode_turbo (dec, jpeg_data, len, ctype, width, height,
+                        raw0, raw1, raw2);
+      if (i != DECODE_SERIAL)
+         return i;
+   }
+#endif
+
+   if (crop && height == dec->crop_h && dec->field_sel == 0)
+      skipped = skip_to_crop (dec, &jpeg_data, &len, 0);
+
+   /* We set up the normal JPEG error routines, then override error_exit. */
+   dinfo->err = jpeg_std_error (&jerr->pub);
+   jerr->pub.error_exit = my_error_exit;
+   /* also hook the emit_message routine to note corrupt-data warnings */
+   jerr->original_emit_message = jerr->pub.emit_message;
+   jerr->pub.emit_message = my_emit_message;
+   jerr->warning_seen = 0;
+
+   /* Establish the setjmp return context for my_error_exit to use. */
+   if (setjmp (jerr->setjmp_buffer)) {
+      /* If we get here, the JPEG code has signaled an error. */
+      decoder_abort (dec);
+      return -1;
+   }
+
+   decoder_start (dec);
+
+   jpeg_buffer_src (dinfo, jpeg_data, len);
+   jpeg_scan_header (jpeg_data, len, &hdr);
+   if (hdr.dht)   /* before jpeg_read_header can overwrite and bail out */
+      dec->std_huff_loaded = 0;
+
+   /* Read header, make some checks and try to figure out what the
+      user really wants */
+
+   jpeg_read_header (dinfo, TRUE);
+   if (hdr.dht)
+      dec->std_huff_loaded = std_huff_tables_present (dinfo);
+   dinfo->raw_data_out = TRUE;
+   dinfo->do_fancy_upsampling = FALSE;
+   dinfo->out_color_space = JCS_YCbCr;
+   dinfo->dct_method = JDCT_IFAST;
+   denom = crop ? 1 : choose_idct_scale (dinfo, width, height);
+   guarantee_huff_tables(dec, dinfo, hdr.dht != 0);
+   jpeg_start_decompress (dinfo);
+
+   if (dinfo->output_components != 3) {
+      mjpeg_error( "Output components of JPEG image = %d, must be 3",
+               dinfo->output_components);
+      goto ERR_EXIT;
+   }
+
+   for (i = 0; i < 3; i++) {
+      hsf[i] = dinfo->comp_info[i].h_samp_factor;
+      vsf[i] = dinfo->comp_info[i].v_samp_factor;
+   }
+
+   //mjpeg_info( "Sampling factors, hsf=(%d, %d, %d) vsf=(%d, %d, %d) !", hsf[0], hsf[1], hsf[2], vsf[0], vsf[1], vsf[2]);
+   if ((hsf[0] != 4 && hsf[0] != 2 && hsf[0] != 1) || hsf[1] != 1 || hsf[2] != 1 ||
+       (vsf[0] != 1 && vsf[0] != 2) || vsf[1] != 1 || vsf[2] != 1) {
+      mjpeg_error( "Unsupported sampling factors, hsf=(%d, %d, %d) vsf=(%d, %d, %d) !", hsf[0], hsf[1], hsf[2], vsf[0], vsf[1], vsf[2]);
       goto ERR_EXIT;
    }
-   if (width < 2 * dinfo.output_width / 3) {
+
+   /*
+    * When scaling, libjpeg may enlarge the chroma DCT instead of leaving
+    * chroma subsampled (e.g. 4:2:0 at 1/2 comes out as 4:4:4).  From
+    * here on hsf[0]/vsf[0] hold the luma:chroma ratios of what is really
+    * delivered, and rows the chroma rows per iMCU row (8 unscaled).
+    */
+
+   rows = dinfo->comp_info[1].DCT_scaled_size;
+   hsf[0] = hsf[0] * dinfo->comp_info[0].DCT_scaled_size / rows;
+   vsf[0] = vsf[0] * dinfo->comp_info[0].DCT_scaled_size / rows;
+
+   /*
+    * Chroma is stored at the sampling requested by ctype.  Vertically
+    * anything goes; horizontally the JPEG's chroma is either kept as it
+    * is or, for 4:4:4 into 4:2:2/4:2:0, halved first (collapse).
+    */
+
+   chroma_ratios (ctype, &hr, &vr);
+   collapse = hsf[0] == 1 && hr == 2;
+   if (hr != 0 && hsf[0] != hr && !collapse) {
+      mjpeg_error( "Can't store %d:1 subsampled chroma of the JPEG as %d:1",
+               hsf[0], hr);
+      goto ERR_EXIT;
+   }
+   cw = hr ? width / hr : 0;
+   plane_pitches (dec, width, cw, pitch);
+   chroma_out_init (&co, dec, raw1, raw2, pitch, cw);
+
+   if (hsf[0] == 1 && !crop)
+     {
+       if (height % (rows * vsf[0]) != 0)
+	 {
+	   mjpeg_error( "YUV 4:4:4 sampling, but image height %d not dividable by %d !\n", height, rows * vsf[0]);
+	   goto ERR_EXIT;	   
+	 }
+     }
+
+   /* the full 4:4:4 rows go to the context's full1/full2 rows */
+   full = 0;
+   if (collapse)
+     {
+       mjpeg_debug("YUV 4:4:4 sampling encountered, halving chroma");
+       /* libjpeg stores whole blocks, which may exceed output_width */
+       full = dinfo->comp_info[1].width_in_blocks * rows;
+       scanarray[1] = row1_444; 
+       scanarray[2] = row2_444; 
+     }
+
+   /* What is fitted to the request: the image or the crop window */
+
+   iw = dinfo->output_width;
+   ih = dinfo->output_height;
+   xsl = y_lo = 0;
+   if (crop) {
+      iw = dec->crop_w;
+      ih = dec->crop_h;
+      xsl = dec->crop_x;
+      y_lo = dec->crop_y - skipped;
+      if (xsl + iw > dinfo->output_width ||
+          y_lo + ih > dinfo->output_height) {
+         mjpeg_error( "Crop window %dx%d+%d+%d exceeds the %dx%d image",
+                  iw, ih, xsl, dec->crop_y,
+                  dinfo->output_width, dinfo->output_height + skipped);
+         goto ERR_EXIT;
+      }
+   }
+   y_hi = y_lo + ih;
+
+   /* Height match image height or be exact twice the image height */
+
+   if (ih == height) {
+      numfields = 1;
+   } else if (2 * ih == height) {
+      numfields = 2;
+   } else {
+      mjpeg_error(
+               "Read JPEG: requested height = %d, height of image = %d",
+               height, ih);
+      goto ERR_EXIT;
+   }
+
+   /* Width is more flexible */
+
+   if (width < 2 * iw / 3) {
       /* Downsample 2:1 */
 
       hdown = 1;
-      if (2 * width < dinfo.output_width)
-         xsl = (dinfo.output_width - 2 * width) / 2;
-      else
-         xsl = 0;
-   } else if (width == 2 * dinfo.output_width / 3) {
+      if (2 * width < iw)
+         xsl += (iw - 2 * width) / 2;
+   } else if (width == 2 * iw / 3) {
       /* special case of 3:2 downsampling */
 
       hdown = 2;
-      xsl = 0;
    } else {
       /* No downsampling */
 
       hdown = 0;
-      if (width < dinfo.output_width)
-         xsl = (dinfo.output_width - width) / 2;
-      else
-         xsl = 0;
+      if (width < iw)
+         xsl += (iw - width) / 2;
    }
 
-   /* Make xsl even, calculate xsc */
+   /* Make xsl even (a multiple of 4 for 4:1:1), calculate xsc */
 
-   xsl = xsl & ~1;
-   xsc = xsl / 2;
+   xsl = xsl & ~(hr == 4 ? 3 : 1);
+   xsc = hr ? xsl / hr : 0;
+
+   /*
+    * Rows must hold what libjpeg stores (whole blocks) as well as what
+    * the resampling below reads, which for odd requests can run past
+    * output_width.
+    */
+
+   i = dinfo->comp_info[1].width_in_blocks * rows;
+   if (collapse && i < (dinfo->output_width + 1) / 2)
+      i = (dinfo->output_width + 1) / 2;
+   if (i < xsc + 2 * cw + 2)
+      i = xsc + 2 * cw + 2;
+   y = dinfo->comp_info[0].width_in_blocks *
+       dinfo->comp_info[0].DCT_scaled_size;
+   if (y < xsl + 2 * width)
+      y = xsl + 2 * width;
+   if (reserve_rows (dec, y, i, full) < 0) {
+      mjpeg_error( "Out of memory for %d pixel wide rows",
+               dinfo->output_width);
+      goto ERR_EXIT;
+   }
+   memcpy (row0, dec->buf0, sizeof (row0));
+   memcpy (row1, dec->buf1, sizeof (row1));
+   memcpy (row2, dec->buf2, sizeof (row2));
+   memcpy (row1_444, dec->full1, sizeof (row1_444));
+   memcpy (row2_444, dec->full2, sizeof (row2_444));
+
+   /*
+    * Without resampling or cropping let libjpeg write straight into the
+    * caller's planes.  It always stores whole blocks, so the rows must
+    * be exactly as wide as the padded component and every iMCU row
+    * must be complete.
+    */
+
+   direct_luma = !crop && hdown == 0 && width == dinfo->output_width &&
+                 dinfo->comp_info[0].width_in_blocks *
+                    dinfo->comp_info[0].DCT_scaled_size == width &&
+                 dinfo->output_height % (rows * vsf[0]) == 0;
+   direct_chroma = direct_luma && !co.semi && hr != 0 && hsf[0] == hr &&
+                   dinfo->comp_info[1].width_in_blocks * rows == cw &&
+                   vsf[0] == vr;
+   if (direct_luma)
+      scanarray[0] = out0;
+   if (direct_chroma) {
+      scanarray[1] = out1;
+      scanarray[2] = out2;
+   }
 
    yl = yc = 0;
 
-   for (field = 0; field < numfields; field++) {
-      if (field > 0) {
-         jpeg_read_header (&dinfo, TRUE);
-         dinfo.raw_data_out = TRUE;
-         dinfo.do_fancy_upsampling = FALSE;
-         dinfo.out_color_space = JCS_YCbCr;
-         dinfo.dct_method = JDCT_IFAST;
-         jpeg_start_decompress (&dinfo);
+   /* a field worker decodes only its own field, cf. decode_fields() */
+   first_field = dec->field_sel ? dec->field_sel - 1 : 0;
+   last_field = dec->field_sel ? first_field + 1 : numfields;
+
+   for (field = first_field; field < last_field; field++) {
+      if (field > first_field) {
+         jpeg_scan_header (dinfo->src->next_input_byte,
+                           dinfo->src->bytes_in_buffer, &hdr);
+         if (hdr.dht)
+            dec->std_huff_loaded = 0;
+         jpeg_read_header (dinfo, TRUE);
+         if (hdr.dht)
+            dec->std_huff_loaded = std_huff_tables_present (dinfo);
+         dinfo->raw_data_out = TRUE;
+         dinfo->do_fancy_upsampling = FALSE;
+         dinfo->out_color_space = JCS_YCbCr;
+         dinfo->dct_method = JDCT_IFAST;
+         dinfo->scale_num = 1;
+         dinfo->scale_denom = denom;
+         jpeg_start_decompress (dinfo);
       }
 
       if (numfields == 2) {
@@ -622,145 +1918,168 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
       } else
          yl = yc = 0;
 
-      while (dinfo.output_scanline < dinfo.output_height) {
+      /* nothing below the window is decoded, if no field follows */
+      y_stop = field + 1 == last_field ? y_hi : (int) dinfo->output_height;
+
+      while ((int) dinfo->output_scanline < y_stop) {
+         ys = dinfo->output_scanline;   /* first luma row of this iMCU row */
+         if (direct_luma)
+            for (y = 0; y < rows * vsf[0]; y++)
+               out0[y] = raw0 + (yl + y * numfields) * pitch[0];
+         if (direct_chroma)
+            for (y = 0; y < rows; y++) {
+               out1[y] = co.raw1 + (yc + y * numfields) * co.pitch1;
+               out2[y] = co.raw2 + (yc + y * numfields) * co.pitch2;
+            }
+
 	/* read raw data */
-	jpeg_read_raw_data (&dinfo, scanarray, 8 * vsf[0]);
-
-         for (y = 0; y < 8 * vsf[0]; yl += numfields, y++) {
-            xd = yl * width;
-            xs = xsl;
-
-            if (hdown == 0)
-               for (x = 0; x < width; x++)
-                  raw0[xd++] = row0[y][xs++];
-            else if (hdown == 1)
-               for (x = 0; x < width; x++, xs += 2)
-                  raw0[xd++] = (row0[y][xs] + row0[y][xs + 1]) >> 1;
-            else
-               for (x = 0; x < width / 2; x++, xd += 2, xs += 3) {
-                  raw0[xd] = (2 * row0[y][xs] + row0[y][xs + 1]) / 3;
-                  raw0[xd + 1] =
-                      (2 * row0[y][xs + 2] + row0[y][xs + 1]) / 3;
+	jpeg_read_raw_data (dinfo, scanarray, rows * vsf[0]);
+         if (ys + rows * vsf[0] <= y_lo)
+            continue;
+
+         /*
+          * Studio range is applied here, to rows that are still in the
+          * cache, instead of in a separate pass over the whole frame.
+          */
+
+         if (direct_luma) {
+            if (studio)
+               for (y = 0; y < rows * vsf[0]; y++)
+                  yuv_range_luma (out0[y], out0[y], width);
+            yl += rows * vsf[0] * numfields;
+         } else
+            for (y = 0; y < rows * vsf[0]; y++) {
+               if (ys + y < y_lo || ys + y >= y_hi)
+                  continue;
+               xd = yl * pitch[0];
+               yl += numfields;
+
+               if (hdown == 0)
+                  put_luma (raw0 + xd, row0[y] + xsl, width);
+               else {
+                  if (hdown == 1)
+                     yuv_hdown_2to1 (raw0 + xd, row0[y] + xsl, width);
+                  else
+                     yuv_hdown_3to2 (raw0 + xd, row0[y] + xsl, width & ~1);
+                  if (studio)
+                     yuv_range_luma (raw0 + xd, raw0 + xd, width);
+               }
+            }
+
+         if (hr == 0)           /* mono: no chroma planes to fill */
+            continue;
+
+         if (direct_chroma) {
+            if (studio)
+               for (y = 0; y < rows; y++) {
+                  yuv_range_chroma (out1[y], out1[y], cw);
+                  yuv_range_chroma (out2[y], out2[y], cw);
                }
+            yc += rows * numfields;
+            continue;
          }
 
 	 /* Horizontal downsampling of chroma */
 
-         for (y = 0; y < 8; y++) {
-            xs = xsc;
-
-	    if (hsf[0] == 1)
-	      for (x = 0; x < width / 2; x++, xs++) 
-		{		  
-		  row1[y][xs] = (row1_444[y][2*x] + row1_444[y][2*x + 1]) >> 1;
-		  row2[y][xs] = (row2_444[y][2*x] + row2_444[y][2*x + 1]) >> 1;
-		}
-
-            xs = xsc;
-            if (hdown == 0)
-               for (x = 0; x < width / 2; x++, xs++) {
-		 chr1[y][x] = row1[y][xs];
-		 chr2[y][x] = row2[y][xs];
-            } else if (hdown == 1)
-               for (x = 0; x < width / 2; x++, xs += 2) {
-                  chr1[y][x] = (row1[y][xs] + row1[y][xs + 1]) >> 1;
-                  chr2[y][x] = (row2[y][xs] + row2[y][xs + 1]) >> 1;
-            } else
-               for (x = 0; x < width / 2; x += 2, xs += 3) {
-                  chr1[y][x] = (2 * row1[y][xs] + row1[y][xs + 1]) / 3;
-                  chr1[y][x + 1] =
-                      (2 * row1[y][xs + 2] + row1[y][xs + 1]) / 3;
-                  chr2[y][x] = (2 * row2[y][xs] + row2[y][xs + 1]) / 3;
-                  chr2[y][x + 1] =
-                      (2 * row2[y][xs + 2] + row2[y][xs + 1]) / 3;
-               }
+         for (y = 0; y < rows; y++) {
+	    if (collapse) {
+	       /* whole row, so cropping and 2:1 below find their input */
+	       yuv_hdown_2to1 (row1[y], row1_444[y], (dinfo->output_width + 1) / 2);
+	       yuv_hdown_2to1 (row2[y], row2_444[y], (dinfo->output_width + 1) / 2);
+	    }
+
+            if (hdown == 0) {
+               memcpy (chr1[y], row1[y] + xsc, cw);
+               memcpy (chr2[y], row2[y] + xsc, cw);
+            } else if (hdown == 1) {
+               yuv_hdown_2to1 (chr1[y], row1[y] + xsc, cw);
+               yuv_hdown_2to1 (chr2[y], row2[y] + xsc, cw);
+            } else {
+               /* pairs of outputs, rounding an odd count up */
+               yuv_hdown_3to2 (chr1[y], row1[y] + xsc, (cw + 1) & ~1);
+               yuv_hdown_3to2 (chr2[y], row2[y] + xsc, (cw + 1) & ~1);
+            }
          }
 
 	 /* Vertical resampling of chroma */
 
-	 switch (ctype) {
-	 case Y4M_CHROMA_422:
+	 if (vr == 1) {
+	   /* 4:2:2, 4:4:4 and 4:1:1: one chroma row per luma row */
 	   if (vsf[0] == 1) {
 	     /* Just copy */
-	     for (y = 0; y < 8 /*&& yc < height */; y++, yc += numfields) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
-	       }
+	     for (y = 0; y < rows; y++) {
+	       if (ys + y < y_lo || ys + y >= y_hi)
+		 continue;
+	       store_chroma (&co, yc, chr1[y], chr2[y]);
+	       yc += numfields;
 	     }
 	   } else {
-	     /* upsample */
-	     for (y = 0; y < 8 /*&& yc < height */; y++) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
-	       }
-	       yc += numfields;
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
-	       }
+	     /* upsample, each chroma row serves two luma rows */
+	     for (y = 0; y < 2 * rows; y++) {
+	       if (ys + y < y_lo || ys + y >= y_hi)
+		 continue;
+	       store_chroma (&co, yc, chr1[y / 2], chr2[y / 2]);
 	       yc += numfields;
 	     }
 	   }
-	   break;
-	 default:
+	 } else {
 /*
- * should be case Y4M_CHROMA_420JPEG: but use default: for compatibility. Some
+ * Anything not listed in chroma_ratios() is 4:2:0, for compatibility. Some
  * pass things like '420' in with the expectation that anything other than
  * Y4M_CHROMA_422 will default to 420JPEG.
 */
 	   if (vsf[0] == 1) {
 	     /* Really downsample */
-	     for (y = 0; y < 8 /*&& yc < height/2*/; y += 2, yc += numfields) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 assert(xd < (width * height / 4));
-		 raw1[xd] = (chr1[y][x] + chr1[y + 1][x]) >> 1;
-		 raw2[xd] = (chr2[y][x] + chr2[y + 1][x]) >> 1;
+	     for (y = 0; y < rows; y += 2) {
+	       if (ys + y < y_lo || ys + y >= y_hi)
+		 continue;
+	       if (co.semi) {
+		 /* average in place, then interleave */
+		 yuv_vavg_2to1 (chr1[y], chr1[y], chr1[y + 1], cw);
+		 yuv_vavg_2to1 (chr2[y], chr2[y], chr2[y + 1], cw);
+		 store_chroma (&co, yc, chr1[y], chr2[y]);
+		 yc += numfields;
+		 continue;
+	       }
+	       assert(yc < height / 2);
+	       c1 = co.raw1 + yc * co.pitch1;
+	       c2 = co.raw2 + yc * co.pitch2;
+	       yc += numfields;
+	       yuv_vavg_2to1 (c1, chr1[y], chr1[y + 1], cw);
+	       yuv_vavg_2to1 (c2, chr2[y], chr2[y + 1], cw);
+	       if (studio) {
+		 yuv_range_chroma (c1, c1, cw);
+		 yuv_range_chroma (c2, c2, cw);
 	       }
 	     }
 
 	   } else {
 	     /* Just copy */
-	     for (y = 0; y < 8 /*&& yc < height/2 */; y++, yc += numfields) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
-	       }
+	     for (y = 0; y < rows; y++) {
+	       if (ys + 2 * y < y_lo || ys + 2 * y >= y_hi)
+		 continue;
+	       store_chroma (&co, yc, chr1[y], chr2[y]);
+	       yc += numfields;
 	     }
 	   }
-	   break;
 	 }
       }
 
-      (void) jpeg_finish_decompress (&dinfo);
-      if (field == 0 && numfields > 1)
-         jpeg_skip_ff (&dinfo);
+      if (dinfo->output_scanline < dinfo->output_height)
+         decoder_abort (dec);
+      else
+         (void) jpeg_finish_decompress (dinfo);
+      if (field + 1 < last_field)
+         jpeg_skip_ff (dinfo);
    }
 
-   if (hsf[0] == 1)
-     {
-       //mjpeg_info("YUV 4:4:4 sampling encountered ! Deallocating special row buffer\n");
-       for (y = 0; y < 16; y++) // allocate a special buffer for the extra sampling depth
-	 {
-	   free(row1_444[y]);
-	   free(row2_444[y]);
-	 }
-     }
-
-   jpeg_destroy_decompress (&dinfo);
-   if(jerr.warning_seen)
+   if(jerr->warning_seen)
 	   return 1;
    else
 	   return 0;
 
  ERR_EXIT:
-   jpeg_destroy_decompress (&dinfo);
+   decoder_abort (dec);
    return -1;
 }
 
@@ -771,7 +2090,10 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
  *                  1: Interlaced, Top field first
  *                  2: Interlaced, Bottom field first
  * ctype            Chroma format for decompression.
- *                  Currently only Y4M_CHROMA_{420JPEG,422} are available
+ *                  Y4M_CHROMA_{420JPEG,422,444,411,MONO}, chroma
+ *                  planes are filled with neutral gray (none for MONO)
+ * raw1, raw2       may be NULL, then only luma is decoded and the
+ *                  caller provides the (constant) chroma itself
  */
 
 
@@ -780,112 +2102,193 @@ int decode_jpeg_gray_raw (unsigned char *jpeg_data, int len,
 			  unsigned char *raw0, unsigned char *raw1,
 			  unsigned char *raw2)
 {
-   int numfields, hsf[3], vsf[3], field, yl, yc, x, y, xsl, xsc, xs, xd,
-       hdown;
-
-   JSAMPROW row0[16] = { buf0[0], buf0[1], buf0[2], buf0[3],
-      buf0[4], buf0[5], buf0[6], buf0[7],
-      buf0[8], buf0[9], buf0[10], buf0[11],
-      buf0[12], buf0[13], buf0[14], buf0[15]
-   };
+   return decode_jpeg_gray_raw_ctx (&default_decoder, jpeg_data, len, itype,
+                                    ctype, width, height, raw0, raw1, raw2);
+}
+
+int decode_jpeg_gray_raw_ctx (jpeg2yuv_decoder_t *dec,
+                              unsigned char *jpeg_data, int len,
+                              int itype, int ctype, int width, int height,
+                              unsigned char *raw0, unsigned char *raw1,
+                              unsigned char *raw2)
+{
+   int numfields, field, yl, yc, y, xsl,
+       hdown, direct_luma, denom, rows, first_field, last_field, hr, vr, cw;
+   long xd, pitch[3];
+   int semi = dec->layout == JPEG2YUV_LAYOUT_NV12 ||
+              dec->layout == JPEG2YUV_LAYOUT_NV21;
+   int crop = dec->crop_w > 0, skipped = 0, iw, ih, ys, y_lo, y_hi, y_stop;
+   int studio = dec->studio_range;
+   void (*put_luma) (uint8_t *, const uint8_t *, int) =
+      studio ? yuv_range_luma : copy_row;
+   int neutral = studio ? yuv_range_chroma_lut[127] : 127;
+
+   JSAMPROW row0[16];
+   JSAMPROW out0[8];
    JSAMPARRAY scanarray[3] = { row0 };
-   struct jpeg_decompress_struct dinfo;
-   struct my_error_mgr jerr;
+   j_decompress_ptr dinfo = &dec->dinfo;
+   jpeg_header_t hdr;
+   struct my_error_mgr *jerr = &dec->jerr;
 
    mjpeg_info("decoding jpeg gray\n");
 
+   if (dec->threads > 1) {
+      y = decode_bands (dec, jpeg_data, len, 1, ctype, width, height,
+                        raw0, raw1, raw2);
+      if (y == DECODE_SERIAL)
+         y = decode_fields (dec, jpeg_data, len, 1, itype, ctype,
+                            width, height, raw0, raw1, raw2);
+      if (y != DECODE_SERIAL)
+         return y;
+   }
+
+   if (crop && height == dec->crop_h && dec->field_sel == 0)
+      skipped = skip_to_crop (dec, &jpeg_data, &len, 1);
+
    /* We set up the normal JPEG error routines, then override error_exit. */
-   dinfo.err = jpeg_std_error (&jerr.pub);
-   jerr.pub.error_exit = my_error_exit;
+   dinfo->err = jpeg_std_error (&jerr->pub);
+   jerr->pub.error_exit = my_error_exit;
 
    /* Establish the setjmp return context for my_error_exit to use. */
-   if (setjmp (jerr.setjmp_buffer)) {
+   if (setjmp (jerr->setjmp_buffer)) {
       /* If we get here, the JPEG code has signaled an error. */
-      jpeg_destroy_decompress (&dinfo);
+      decoder_abort (dec);
       return -1;
    }
 
-   jpeg_create_decompress (&dinfo);
+   decoder_start (dec);
 
-   jpeg_buffer_src (&dinfo, jpeg_data, len);
+   jpeg_buffer_src (dinfo, jpeg_data, len);
+   jpeg_scan_header (jpeg_data, len, &hdr);
+   if (hdr.dht)   /* before jpeg_read_header can overwrite and bail out */
+      dec->std_huff_loaded = 0;
 
    /* Read header, make some checks and try to figure out what the
       user really wants */
 
-   jpeg_read_header (&dinfo, TRUE);
-   dinfo.raw_data_out = TRUE;
-   dinfo.out_color_space = JCS_GRAYSCALE;
-   dinfo.dct_method = JDCT_IFAST;
+   jpeg_read_header (dinfo, TRUE);
+   if (hdr.dht)
+      dec->std_huff_loaded = std_huff_tables_present (dinfo);
+   dinfo->raw_data_out = TRUE;
+   dinfo->out_color_space = JCS_GRAYSCALE;
+   dinfo->dct_method = JDCT_IFAST;
 
-   if (dinfo.jpeg_color_space != JCS_GRAYSCALE) 
+   if (dinfo->jpeg_color_space != JCS_GRAYSCALE) 
      {
        mjpeg_error( "FATAL: Expected grayscale colorspace for JPEG raw decoding");
        goto ERR_EXIT;
      }
 
-   guarantee_huff_tables(&dinfo);
-   jpeg_start_decompress (&dinfo);
-
-   hsf[0] = 1; hsf[1] = 1; hsf[2] = 1;
-   vsf[0]= 1; vsf[1] = 1; vsf[2] = 1;
+   denom = crop ? 1 : choose_idct_scale (dinfo, width, height);
+   guarantee_huff_tables(dec, dinfo, hdr.dht != 0);
+   jpeg_start_decompress (dinfo);
+
+   /* rows per iMCU row, 8 unless scaled, cf. choose_idct_scale */
+   rows = dinfo->min_DCT_scaled_size;
+   chroma_ratios (ctype, &hr, &vr);
+   if (raw1 == NULL || (raw2 == NULL && !semi))  /* caller provides chroma */
+      hr = vr = 0;
+   cw = hr ? width / hr : 0;
+   plane_pitches (dec, width, cw, pitch);
+
+   /* What is fitted to the request, cf. decode_jpeg_raw_ctx */
+
+   iw = dinfo->output_width;
+   ih = dinfo->output_height;
+   xsl = y_lo = 0;
+   if (crop) {
+      iw = dec->crop_w;
+      ih = dec->crop_h;
+      xsl = dec->crop_x;
+      y_lo = dec->crop_y - skipped;
+      if (xsl + iw > dinfo->output_width ||
+          y_lo + ih > dinfo->output_height) {
+         mjpeg_error( "Crop window %dx%d+%d+%d exceeds the %dx%d image",
+                  iw, ih, xsl, dec->crop_y,
+                  dinfo->output_width, dinfo->output_height + skipped);
+         goto ERR_EXIT;
+      }
+   }
+   y_hi = y_lo + ih;
 
    /* Height match image height or be exact twice the image height */
 
-   if (dinfo.output_height == height) {
+   if (ih == height) {
       numfields = 1;
-   } else if (2 * dinfo.output_height == height) {
+   } else if (2 * ih == height) {
       numfields = 2;
    } else {
       mjpeg_error(
                "Read JPEG: requested height = %d, height of image = %d",
-               height, dinfo.output_height);
+               height, ih);
       goto ERR_EXIT;
    }
 
    /* Width is more flexible */
 
-   if (dinfo.output_width > MAX_LUMA_WIDTH) {
-      mjpeg_error( "Image width of %d exceeds max",
-               dinfo.output_width);
-      goto ERR_EXIT;
-   }
-   if (width < 2 * dinfo.output_width / 3) {
+   if (width < 2 * iw / 3) {
       /* Downsample 2:1 */
 
       hdown = 1;
-      if (2 * width < dinfo.output_width)
-         xsl = (dinfo.output_width - 2 * width) / 2;
-      else
-         xsl = 0;
-   } else if (width == 2 * dinfo.output_width / 3) {
+      if (2 * width < iw)
+         xsl += (iw - 2 * width) / 2;
+   } else if (width == 2 * iw / 3) {
       /* special case of 3:2 downsampling */
 
       hdown = 2;
-      xsl = 0;
    } else {
       /* No downsampling */
 
       hdown = 0;
-      if (width < dinfo.output_width)
-         xsl = (dinfo.output_width - width) / 2;
-      else
-         xsl = 0;
+      if (width < iw)
+         xsl += (iw - width) / 2;
    }
 
-   /* Make xsl even, calculate xsc */
+   /* Make xsl even */
 
    xsl = xsl & ~1;
-   xsc = xsl / 2;
+
+   /* cf. decode_jpeg_raw_ctx */
+
+   y = dinfo->comp_info[0].width_in_blocks * rows;
+   if (y < xsl + 2 * width)
+      y = xsl + 2 * width;
+   if (reserve_rows (dec, y, 0, 0) < 0) {
+      mjpeg_error( "Out of memory for %d pixel wide rows",
+               dinfo->output_width);
+      goto ERR_EXIT;
+   }
+   memcpy (row0, dec->buf0, sizeof (row0));
+
+   /* Uncropped, unscaled luma is decoded in place, cf. decode_jpeg_raw */
+
+   direct_luma = !crop && hdown == 0 && width == dinfo->output_width &&
+                 dinfo->comp_info[0].width_in_blocks * rows == width &&
+                 dinfo->output_height % rows == 0;
+   if (direct_luma)
+      scanarray[0] = out0;
 
    yl = yc = 0;
 
-   for (field = 0; field < numfields; field++) {
-      if (field > 0) {
-         jpeg_read_header (&dinfo, TRUE);
-         dinfo.raw_data_out = TRUE;
-         dinfo.out_color_space = JCS_GRAYSCALE;
-         dinfo.dct_method = JDCT_IFAST;
-         jpeg_start_decompress (&dinfo);
+   /* a field worker decodes only its own field, cf. decode_fields() */
+   first_field = dec->field_sel ? dec->field_sel - 1 : 0;
+   last_field = dec->field_sel ? first_field + 1 : numfields;
+
+   for (field = first_field; field < last_field; field++) {
+      if (field > first_field) {
+         jpeg_scan_header (dinfo->src->next_input_byte,
+                           dinfo->src->bytes_in_buffer, &hdr);
+         if (hdr.dht)
+            dec->std_huff_loaded = 0;
+         jpeg_read_header (dinfo, TRUE);
+         if (hdr.dht)
+            dec->std_huff_loaded = std_huff_tables_present (dinfo);
+         dinfo->raw_data_out = TRUE;
+         dinfo->out_color_space = JCS_GRAYSCALE;
+         dinfo->dct_method = JDCT_IFAST;
+         dinfo->scale_num = 1;
+         dinfo->scale_denom = denom;
+         jpeg_start_decompress (dinfo);
       }
 
       if (numfields == 2) {
@@ -904,122 +2307,71 @@ int decode_jpeg_gray_raw (unsigned char *jpeg_data, int len,
       } else
          yl = yc = 0;
 
-      while (dinfo.output_scanline < dinfo.output_height) {
-         jpeg_read_raw_data (&dinfo, scanarray, 16);
-
-         for (y = 0; y < 8 * vsf[0]; yl += numfields, y++) {
-            xd = yl * width;
-            xs = xsl;
-
-            if (hdown == 0) // no horiz downsampling
-               for (x = 0; x < width; x++)
-                  raw0[xd++] = row0[y][xs++];
-            else if (hdown == 1) // half the res
-               for (x = 0; x < width; x++, xs += 2)
-                  raw0[xd++] = (row0[y][xs] + row0[y][xs + 1]) >> 1;
-            else // 2:3 downsampling
-               for (x = 0; x < width / 2; x++, xd += 2, xs += 3) {
-                  raw0[xd] = (2 * row0[y][xs] + row0[y][xs + 1]) / 3;
-                  raw0[xd + 1] =
-                      (2 * row0[y][xs + 2] + row0[y][xs + 1]) / 3;
+      y_stop = field + 1 == last_field ? y_hi : (int) dinfo->output_height;
+
+      while ((int) dinfo->output_scanline < y_stop) {
+         ys = dinfo->output_scanline;
+         if (direct_luma)
+            for (y = 0; y < rows; y++)
+               out0[y] = raw0 + (yl + y * numfields) * pitch[0];
+
+         jpeg_read_raw_data (dinfo, scanarray, rows);
+         if (ys + rows <= y_lo)
+            continue;
+
+         if (direct_luma) {
+            if (studio)
+               for (y = 0; y < rows; y++)
+                  yuv_range_luma (out0[y], out0[y], width);
+            yl += rows * numfields;
+         } else
+            for (y = 0; y < rows; y++) {
+               if (ys + y < y_lo || ys + y >= y_hi)
+                  continue;
+               xd = yl * pitch[0];
+               yl += numfields;
+
+               if (hdown == 0) // no horiz downsampling
+                  put_luma (raw0 + xd, row0[y] + xsl, width);
+               else {
+                  if (hdown == 1) // half the res
+                     yuv_hdown_2to1 (raw0 + xd, row0[y] + xsl, width);
+                  else // 2:3 downsampling
+                     yuv_hdown_3to2 (raw0 + xd, row0[y] + xsl, width & ~1);
+                  if (studio)
+                     yuv_range_luma (raw0 + xd, raw0 + xd, width);
                }
+            }
+
+         /* No chroma in a gray image, fill in neutral rows: one per
+            luma row for 4:2:2 and the like, one per two for 4:2:0,
+            none for mono */
+
+         for (y = 0; vr != 0 && y < rows; y += vr) {
+            if (ys + y < y_lo || ys + y >= y_hi)
+               continue;
+            if (semi)           /* one plane of pairs */
+               memset (raw1 + yc * pitch[1], neutral, 2 * cw);
+            else {
+               memset (raw1 + yc * pitch[1], neutral, cw);
+               memset (raw2 + yc * pitch[2], neutral, cw);
+            }
+            yc += numfields;
          }
-
-         //mjpeg_info("/* Horizontal downsampling of chroma - in Grayscale, all this is ZERO ! */");
-
-         for (y = 0; y < 8; y++) {
-            xs = xsc;
-
-            if (hdown == 0)
-               for (x = 0; x < width / 2; x++, xs++) {
-		 chr1[y][x] = 0; //row1[y][xs];
-		 chr2[y][x] = 0; //row2[y][xs];
-            } else if (hdown == 1)
-               for (x = 0; x < width / 2; x++, xs += 2) {
-		 chr1[y][x] = 0; //(row1[y][xs] + row1[y][xs + 1]) >> 1;
-		 chr2[y][x] = 0; //(row2[y][xs] + row2[y][xs + 1]) >> 1;
-            } else
-               for (x = 0; x < width / 2; x += 2, xs += 3) {
-		 chr1[y][x] = 0; //(2 * row1[y][xs] + row1[y][xs + 1]) / 3;
-		 chr1[y][x + 1] = 0;
-		 //(2 * row1[y][xs + 2] + row1[y][xs + 1]) / 3;
-		 chr2[y][x] = 0; // (2 * row2[y][xs] + row2[y][xs + 1]) / 3;
-		 chr2[y][x + 1] = 0;
-		 //(2 * row2[y][xs + 2] + row2[y][xs + 1]) / 3;
-               }
-         }
-
-         //mjpeg_info("/* Vertical downsampling of chroma, line %d, max %d */", dinfo.output_scanline, dinfo.output_height);
-
-	 switch (ctype) {
-	 case Y4M_CHROMA_422:
-	   if (vsf[0] == 1) {
-	     /* Just copy */
-	     for (y = 0; y < 8 /*&& yc < height */; y++, yc += numfields) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = 127; //chr1[y][x];
-		 raw2[xd] = 127; //chr2[y][x];
-	       }
-	     }
-	   } else {
-	     /* upsample */
-	     for (y = 0; y < 8 /*&& yc < height */; y++) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = 127; //chr1[y][x];
-		 raw2[xd] = 127; //chr2[y][x];
-	       }
-	       yc += numfields;
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = 127; //chr1[y][x];
-		 raw2[xd] = 127; //chr2[y][x];
-	       }
-	       yc += numfields;
-	     }
-	   }
-	   break;
-/*
- * should be case Y4M_CHROMA_420JPEG: but use default: for compatibility. Some
- * pass things like '420' in with the expectation that anything other than
- * Y4M_CHROMA_422 will default to 420JPEG.
-*/
-	 default:
-	   if (vsf[0] == 1) {
-	     /* Really downsample */
-	     for (y = 0; y < 8; y += 2, yc += numfields) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = 127; //(chr1[y][x] + chr1[y + 1][x]) >> 1;
-		 raw2[xd] = 127; //(chr2[y][x] + chr2[y + 1][x]) >> 1;
-	       }
-	     }
-	   } else {
-	     /* Just copy */
-
-	     for (y = 0; y < 8; y++, yc += numfields) {
-	       xd = yc * width / 2;
-	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = 127; //chr1[y][x];
-		 raw2[xd] = 127; //chr2[y][x];
-	       }
-	     }
-	   }
-	   break;
-	 }
       }
 
-      (void) jpeg_finish_decompress (&dinfo);
-      if (field == 0 && numfields > 1)
-         jpeg_skip_ff (&dinfo);
+      if (dinfo->output_scanline < dinfo->output_height)
+         decoder_abort (dec);
+      else
+         (void) jpeg_finish_decompress (dinfo);
+      if (field + 1 < last_field)
+         jpeg_skip_ff (dinfo);
    }
 
-   jpeg_destroy_decompress (&dinfo);
    return 0;
 
  ERR_EXIT:
-   jpeg_destroy_decompress (&dinfo);
+   decoder_abort (dec);
    return -1;
 }
 
@@ -1031,14 +2383,143 @@ int decode_jpeg_gray_raw (unsigned char *jpeg_data, int len,
  *                                                                 *
  *******************************************************************/
  
+/*
+ * Parallel encoding: a frame is cut into up to dec->threads bands of
+ * whole MCU rows, which the worker contexts encode concurrently as
+ * JPEGs of their own, all with the same tables and a restart interval
+ * of one MCU row.  The bands are then stitched into one frame: the
+ * headers of the first band with the SOF height patched (its DRI
+ * already covers all of them), the entropy coded data of every band
+ * with a RSTn marker in between and all markers renumbered, and an EOI.
+ * Restarting the DC prediction at the band boundaries is exactly what
+ * a RSTn does, so the result decodes with any libjpeg.
+ *
+ * Only single images are split, fields are encoded as usual.  The
+ * workers write to buffers of their own which grow as needed; with
+ * grow set, so does the frame's at *jpeg_data.
+ */
+
+static int encode_bands (jpeg2yuv_decoder_t *dec,
+                         unsigned char **jpeg_buf, long *jpeg_len, int grow,
+                         int quality, int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2)
+{
+   decode_job_t job[JPEG2YUV_MAX_THREADS];
+   jpeg_header_t hdr;
+   long pitch[3], out, p, start, len;
+   int mcu_h, mcu_rows, rpb, nbands, b, y0, yc0, rst;
+   unsigned char *band, *jpeg_data;
+
+   if (dec->threads < 2)
+      return DECODE_SERIAL;
+
+   pitch[0] = dec->pitch[0] ? dec->pitch[0] : width;
+   pitch[1] = dec->pitch[1] ? dec->pitch[1] : width / 2;
+   pitch[2] = dec->pitch[2] ? dec->pitch[2] : width / 2;
+
+   /* MCUs are 16x8 for 4:2:2 and 16x16 for 4:2:0, the last one of
+      the frame may be cut short by its edge */
+   mcu_h = ctype == Y4M_CHROMA_422 ? 8 : 16;
+   mcu_rows = (height + mcu_h - 1) / mcu_h;
+   rpb = (mcu_rows + dec->threads - 1) / dec->threads;
+   nbands = (mcu_rows + rpb - 1) / rpb;
+   if (nbands < 2)
+      return DECODE_SERIAL;
+
+   for (b = 0; b < nbands; b++) {
+      y0 = b * rpb * mcu_h;
+      yc0 = ctype == Y4M_CHROMA_422 ? y0 : y0 / 2;
+
+      job[b].dec = dec->workers[b];
+      if (grow_buffer ((void **) &job[b].dec->band_jpeg,
+                       &job[b].dec->band_jpeg_size,
+                       *jpeg_len / nbands + 4096) < 0)
+         return DECODE_SERIAL;
+      job[b].encode = 1;
+      job[b].quality = quality;
+      job[b].gray = 0;
+      job[b].itype = 0;
+      job[b].ctype = ctype;
+      job[b].width = width;
+      job[b].height = y0 + rpb * mcu_h < height ? rpb * mcu_h : height - y0;
+      job[b].raw0 = raw0 + y0 * pitch[0];
+      job[b].raw1 = raw1 + yc0 * pitch[1];
+      job[b].raw2 = raw2 + yc0 * pitch[2];
+      job[b].dec->threads = 1;
+      job[b].dec->restart_rows = 1;
+      memcpy (job[b].dec->pitch, dec->pitch, sizeof (dec->pitch));
+   }
+
+   mjpeg_debug ("Encoding %d bands of %d MCU rows each", nbands, rpb);
+
+   if (run_jobs (job, nbands) < 0)
+      return -1;
+
+   /* the frame needs no more than the bands, with an RSTn between them */
+   len = 0;
+   for (b = 0; b < nbands; b++)
+      len += job[b].result + 2;
+   if (grow && grow_buffer ((void **) jpeg_buf, jpeg_len, len) < 0)
+      return -1;
+   jpeg_data = *jpeg_buf;
+   len = *jpeg_len;
+
+   /* headers of the first band, with the height of the whole frame */
+   band = job[0].dec->band_jpeg;
+   if (jpeg_scan_header (band, job[0].result, &hdr) < 0 || hdr.sof == 0 ||
+       hdr.data > len)
+      return -1;
+   memcpy (jpeg_data, band, hdr.data);
+   jpeg_data[hdr.sof + 5] = height >> 8;
+   jpeg_data[hdr.sof + 6] = height & 0xFF;
+   out = hdr.data;
+
+   /* then the entropy coded data of all bands, RSTn renumbered */
+   rst = 0;
+   for (b = 0; b < nbands; b++) {
+      band = job[b].dec->band_jpeg;
+      start = hdr.data;         /* the bands' headers are all alike */
+      if (b > 0) {
+         if (out + 2 > len)
+            goto TOO_SMALL;
+         jpeg_data[out++] = 0xFF;
+         jpeg_data[out++] = 0xD0 + (rst++ & 7);
+      }
+      /* everything up to the EOI, libjpeg writes it last */
+      if (out + job[b].result - 2 - start > len)
+         goto TOO_SMALL;
+      for (p = start; p < job[b].result - 2; p++) {
+         jpeg_data[out++] = band[p];
+         if (band[p] == 0xFF && band[p + 1] >= 0xD0 && band[p + 1] <= 0xD7) {
+            jpeg_data[out++] = 0xD0 + (rst++ & 7);
+            p++;
+         }
+      }
+   }
+   if (out + 2 > len)
+      goto TOO_SMALL;
+   jpeg_data[out++] = 0xFF;
+   jpeg_data[out++] = M_EOI;
+   return out;
+
+ TOO_SMALL:
+   mjpeg_error( "Given jpeg buffer was too small!");
+   return -1;
+}
+
  /*
  * jpeg_data:       Buffer to hold output jpeg
  * len:             Length of buffer
  * itype:           0: Not interlaced
  *                  1: Interlaced, Top field first
  *                  2: Interlaced, Bottom field first
- * ctype            Chroma format for decompression.
- *                  Currently only Y4M_CHROMA_{420JPEG,422} are available
+ * ctype            Chroma format of the input.
+ *                  Currently only Y4M_CHROMA_{420JPEG,422} are available,
+ *                  encoded as 2x2 and 2x1 subsampled JPEG respectively
+ * width, height    Any size up to JPEG_MAX_DIMENSION; frames that are not
+ *                  a whole number of MCUs are padded by repeating their
+ *                  right and bottom edges
  */
 
 int encode_jpeg_raw (unsigned char *jpeg_data, int len, int quality,
@@ -1046,68 +2527,142 @@ int encode_jpeg_raw (unsigned char *jpeg_data, int len, int quality,
                      unsigned char *raw0, unsigned char *raw1,
                      unsigned char *raw2)
 {
-   int numfields, field, yl, yc, y, i;
-
-   JSAMPROW row0[16] = { buf0[0], buf0[1], buf0[2], buf0[3],
-      buf0[4], buf0[5], buf0[6], buf0[7],
-      buf0[8], buf0[9], buf0[10], buf0[11],
-      buf0[12], buf0[13], buf0[14], buf0[15]
-   };
-   JSAMPROW row1[8] = { buf1[0], buf1[1], buf1[2], buf1[3],
-      buf1[4], buf1[5], buf1[6], buf1[7]
-   };
-   JSAMPROW row2[8] = { buf2[0], buf2[1], buf2[2], buf2[3],
-      buf2[4], buf2[5], buf2[6], buf2[7]
-   };
-   JSAMPARRAY scanarray[3] = { row0, row1, row2 };
+   return encode_jpeg_raw_ctx (&default_decoder, jpeg_data, len, quality,
+                               itype, ctype, width, height, raw0, raw1, raw2);
+}
 
-   struct jpeg_compress_struct cinfo;
-   struct my_error_mgr jerr;
+/*
+ * Like the decompressor, the compressor lives as long as the context.
+ * jpeg_set_defaults() and jpeg_set_quality(), which build the
+ * quantization and Huffman tables, only run again when the quality or
+ * the restart interval changes; the per frame settings are made by the
+ * caller every time.  Every frame must carry its tables, so they are
+ * marked as not yet written.
+ */
 
-   /* We set up the normal JPEG error routines, then override error_exit. */
-   cinfo.err = jpeg_std_error (&jerr.pub);
-   jerr.pub.error_exit = my_error_exit;
+static void encoder_start (jpeg2yuv_decoder_t *dec, int quality)
+{
+   j_compress_ptr cinfo = &dec->cinfo;
 
-   /* Establish the setjmp return context for my_error_exit to use. */
-   if (setjmp (jerr.setjmp_buffer)) {
-      /* If we get here, the JPEG code has signaled an error. */
-      jpeg_destroy_compress (&cinfo);
-      return -1;
+   if (!dec->cinfo_created) {
+      jpeg_create_compress (cinfo);
+      dec->cinfo_created = 1;
+   } else {
+      jpeg_abort_compress (cinfo);
+      if (quality == dec->cinfo_quality &&
+          dec->restart_rows == dec->cinfo_restart) {
+         jpeg_suppress_tables (cinfo, FALSE);
+         return;
+      }
    }
 
-   jpeg_create_compress (&cinfo);
+   /* Set some jpeg header fields */
 
-   jpeg_buffer_dest(&cinfo, jpeg_data, len);
+   /* as on a fresh object, so the frames come out as they always did */
+   cinfo->input_components = 3;
+   cinfo->in_color_space = JCS_UNKNOWN;
+   jpeg_set_defaults (cinfo);
+   jpeg_set_quality  (cinfo, quality, FALSE);
+   cinfo->restart_in_rows = dec->restart_rows;
 
-   /* Set some jpeg header fields */
+   cinfo->raw_data_in = TRUE;
+   cinfo->in_color_space = JCS_YCbCr;
+   cinfo->dct_method = JDCT_IFAST;
 
-   cinfo.input_components = 3;
-   jpeg_set_defaults (&cinfo);
-   jpeg_set_quality  (&cinfo, quality, FALSE);
+   cinfo->input_gamma = 1.0;
 
-   cinfo.raw_data_in = TRUE;
-   cinfo.in_color_space = JCS_YCbCr;
-   cinfo.dct_method = JDCT_IFAST;
+   cinfo->comp_info[0].h_samp_factor = 2;
+   cinfo->comp_info[1].h_samp_factor = 1;
+   cinfo->comp_info[1].v_samp_factor = 1;
+   cinfo->comp_info[2].h_samp_factor = 1;	/*1||2 */
+   cinfo->comp_info[2].v_samp_factor = 1;
 
-   cinfo.input_gamma = 1.0;
+   dec->cinfo_quality = quality;
+   dec->cinfo_restart = dec->restart_rows;
 
-   cinfo.comp_info[0].h_samp_factor = 2;
-   cinfo.comp_info[0].v_samp_factor = 1;	/*1||2 */
-   cinfo.comp_info[1].h_samp_factor = 1;
-   cinfo.comp_info[1].v_samp_factor = 1;
-   cinfo.comp_info[2].h_samp_factor = 1;	/*1||2 */
-   cinfo.comp_info[2].v_samp_factor = 1;
+   /* jpeg_set_defaults() keeps the Huffman tables it finds */
+   jpeg_suppress_tables (cinfo, FALSE);
+}
 
+/*
+ * Points rows[0..n-1] at the rows first, first+1, ... of a plane of
+ * nrows rows of w samples, repeating the last row past the bottom.
+ * libjpeg reads whole blocks, so when w falls short of the padded
+ * width pw the rows are copied to pad instead, the last sample of each
+ * repeated up to pw.
+ */
 
-   if ((width>4096)||(height>4096)) {
-      mjpeg_error( "Image dimensions (%dx%d) exceed lavtools' max (4096x4096)", width, height);
-      goto ERR_EXIT;
+static void encode_rows (JSAMPROW *rows, int n, unsigned char *plane,
+                         long pitch, int first, int nrows, int w, int pw,
+                         unsigned char *pad)
+{
+   int y, r;
+
+   for (y = 0; y < n; y++) {
+      r = first + y < nrows ? first + y : nrows - 1;
+      rows[y] = &plane[r * pitch];
+      if (w < pw) {
+         memcpy (pad, rows[y], w);
+         memset (pad + w, pad[w - 1], pw - w);
+         rows[y] = pad;
+         pad += pw;
+      }
    }
-   if ((width%16)||(height%16)) {
-      mjpeg_error( "Image dimensions (%dx%d) not multiples of 16", width, height);
+}
+
+/*
+ * encode_jpeg_raw_ctx() to the buffer *jpeg_buf of *jpeg_len bytes,
+ * which with grow set is a malloc()ed one, grown if the frame needs it.
+ */
+
+static int encode_frame (jpeg2yuv_decoder_t *dec,
+                         unsigned char **jpeg_buf, long *jpeg_len, int grow,
+                         int quality, int itype, int ctype,
+                         int width, int height, unsigned char *raw0,
+                         unsigned char *raw1, unsigned char *raw2)
+{
+   int numfields, field, off, vsamp, cw, ch, pw, y, i;
+   long pitch[3];
+   unsigned char *pad;
+
+   /* rows point straight into the caller's planes unless padded */
+   JSAMPROW row0[16], row1[8], row2[8];
+   JSAMPARRAY scanarray[3] = { row0, row1, row2 };
+
+   j_compress_ptr cinfo = &dec->cinfo;
+   struct my_error_mgr *jerr = &dec->jerr;
+
+   if (dec->threads > 1 && itype != Y4M_ILACE_TOP_FIRST &&
+       itype != Y4M_ILACE_BOTTOM_FIRST) {
+      i = encode_bands (dec, jpeg_buf, jpeg_len, grow, quality, ctype,
+                        width, height, raw0, raw1, raw2);
+      if (i != DECODE_SERIAL)
+         return i;
+   }
+
+   /* We set up the normal JPEG error routines, then override error_exit. */
+   cinfo->err = jpeg_std_error (&jerr->pub);
+   jerr->pub.error_exit = my_error_exit;
+
+   /* Establish the setjmp return context for my_error_exit to use. */
+   if (setjmp (jerr->setjmp_buffer)) {
+      /* If we get here, the JPEG code has signaled an error. */
+      jpeg_abort_compress (cinfo);
+      return -1;
+   }
+
+   encoder_start (dec, quality);
+
+   if (grow)
+      jpeg_grow_dest (cinfo, jpeg_buf, jpeg_len);
+   else
+      jpeg_buffer_dest(cinfo, *jpeg_buf, *jpeg_len);
+
+   if ((width>JPEG_MAX_DIMENSION)||(height>JPEG_MAX_DIMENSION)) {
+      mjpeg_error( "Image dimensions (%dx%d) exceed JPEG's max (%ldx%ld)", width, height, JPEG_MAX_DIMENSION, JPEG_MAX_DIMENSION);
       goto ERR_EXIT;
    }
-   cinfo.image_width = width;
+   cinfo->image_width = width;
    switch (itype) {
    case Y4M_ILACE_TOP_FIRST:
    case Y4M_ILACE_BOTTOM_FIRST: /* interlaced */
@@ -1115,31 +2670,48 @@ int encode_jpeg_raw (unsigned char *jpeg_data, int len, int quality,
       break;
    default:
       numfields = 1;
-      if (height > 2048) {
-         mjpeg_error( "Image height (%d) exceeds lavtools max for non-interlaced frames", height);
-         goto ERR_EXIT;
-      }
    }
-   cinfo.image_height = height/numfields;
+   cinfo->image_height = height/numfields;
+
+   /* 4:2:0 goes out 2x2 subsampled, one JPEG chroma row per input row */
+   vsamp = ctype == Y4M_CHROMA_422 ? 1 : 2;
+   cinfo->comp_info[0].v_samp_factor = vsamp;
+   cw = width / 2;
+   ch = height / vsamp;
+   if (cw < 1 || ch < numfields) {
+      mjpeg_error( "Image dimensions (%dx%d) too small", width, height);
+      goto ERR_EXIT;
+   }
 
-   yl = yc = 0;                 /* y luma, chroma */
+   pitch[0] = dec->pitch[0] ? dec->pitch[0] : width;
+   pitch[1] = dec->pitch[1] ? dec->pitch[1] : width / 2;
+   pitch[2] = dec->pitch[2] ? dec->pitch[2] : width / 2;
+
+   /* room for one iMCU row of padded rows, if the width needs it */
+   pw = (width + 15) & ~15;
+   if (pw != width &&
+       grow_buffer ((void **) &dec->enc_pad, &dec->enc_pad_size,
+                    16L * pw + 16L * (pw / 2)) < 0) {
+      mjpeg_error( "Out of memory");
+      goto ERR_EXIT;
+   }
 
    for (field = 0; field < numfields; field++) {
 
-      jpeg_start_compress (&cinfo, FALSE);
+      jpeg_start_compress (cinfo, FALSE);
       
       if (numfields == 2) {
          static const JOCTET marker0[40];
 
-	 jpeg_write_marker(&cinfo, JPEG_APP0,   marker0, 14);
-	 jpeg_write_marker(&cinfo, JPEG_APP0+1, marker0, 40);
+	 jpeg_write_marker(cinfo, JPEG_APP0,   marker0, 14);
+	 jpeg_write_marker(cinfo, JPEG_APP0+1, marker0, 40);
 
          switch (itype) {
          case Y4M_ILACE_TOP_FIRST: /* top field first */
-            yl = yc = field;
+            off = field;
             break;
          case Y4M_ILACE_BOTTOM_FIRST: /* bottom field first */
-            yl = yc = (1 - field);
+            off = (1 - field);
             break;
          default:
             mjpeg_error(
@@ -1147,37 +2719,183 @@ int encode_jpeg_raw (unsigned char *jpeg_data, int len, int quality,
             goto ERR_EXIT;
          }
       } else
-         yl = yc = 0;
-
-      while (cinfo.next_scanline < cinfo.image_height) {
-
-         for (y = 0; y < 8 * cinfo.comp_info[0].v_samp_factor;
-              yl += numfields, y++) {
-            row0[y] = &raw0[yl * width];
-         }
-         for (y = 0; y < 8; y++) {
-            row1[y] = &raw1[yc * width / 2];
-            row2[y] = &raw2[yc * width / 2];
-            if ((ctype == Y4M_CHROMA_422) || (y%2))
-               yc += numfields;
-         }
-
-         jpeg_write_raw_data (&cinfo, scanarray,
-                              8 * cinfo.comp_info[0].v_samp_factor);
+         off = 0;
+
+      while (cinfo->next_scanline < cinfo->image_height) {
+
+         y = cinfo->next_scanline;
+         pad = dec->enc_pad;
+         encode_rows (row0, 8 * vsamp, raw0 + off * pitch[0],
+                      numfields * pitch[0], y, height / numfields,
+                      width, pw, pad);
+         pad += 16 * pw;
+         encode_rows (row1, 8, raw1 + off * pitch[1],
+                      numfields * pitch[1], y / vsamp, ch / numfields,
+                      cw, pw / 2, pad);
+         pad += 8 * (pw / 2);
+         encode_rows (row2, 8, raw2 + off * pitch[2],
+                      numfields * pitch[2], y / vsamp, ch / numfields,
+                      cw, pw / 2, pad);
+
+         jpeg_write_raw_data (cinfo, scanarray, 8 * vsamp);
 
       }
 
-      (void) jpeg_finish_compress (&cinfo);
+      (void) jpeg_finish_compress (cinfo);
    }
    
    /* FIXME */
-   i = len - cinfo.dest->free_in_buffer;
-
-   jpeg_destroy_compress (&cinfo);
+   i = ((mem_destination_mgr *) cinfo->dest)->len -
+       cinfo->dest->free_in_buffer;
 
    return i;   /* size of jpeg */
 
  ERR_EXIT:
-   jpeg_destroy_compress (&cinfo);
+   jpeg_abort_compress (cinfo);
    return -1;
 }
+
+/*
+ * Rate control.  jpeg_set_quality() scales the standard tables by
+ * 5000 / quality percent below 50 and by 200 - 2 * quality above, and
+ * the size of a frame falls somewhat slower than that scale rises.  So
+ * scaling it by the ratio of the last frame's size to the target gets
+ * the next frame closer without overshooting it.  A frame over the
+ * target is encoded again at the quality its own size suggests, at
+ * most RATE_RETRIES times, and then kept as it is.
+ */
+
+#define RATE_RETRIES 2
+
+static int rate_next_quality (int quality, long size, long target)
+{
+   double scale;
+
+   scale = quality < 50 ? 5000.0 / quality : 200.0 - 2 * quality;
+   if (scale < 1)
+      scale = 1;                /* quality 100 would not move otherwise */
+   scale *= (double) size / target;
+
+   quality = scale > 100 ? (int) (5000 / scale + 0.5)
+                         : (int) ((200 - scale) / 2 + 0.5);
+   return quality < 1 ? 1 : quality > 100 ? 100 : quality;
+}
+
+static int encode_rated (jpeg2yuv_decoder_t *dec,
+                         unsigned char **jpeg_buf, long *jpeg_len, int grow,
+                         int quality, int itype, int ctype,
+                         int width, int height, unsigned char *raw0,
+                         unsigned char *raw1, unsigned char *raw2)
+{
+   int n, tries;
+
+   if (dec->target_size == 0) {
+      dec->quality = quality;
+      return encode_frame (dec, jpeg_buf, jpeg_len, grow, quality, itype,
+                           ctype, width, height, raw0, raw1, raw2);
+   }
+
+   /* the caller's quality only until there is a frame to go by */
+   if (dec->rate_quality)
+      quality = dec->rate_quality;
+   else
+      quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+
+   for (tries = 0; ; tries++) {
+      n = encode_frame (dec, jpeg_buf, jpeg_len, grow, quality, itype,
+                        ctype, width, height, raw0, raw1, raw2);
+      if (n < 0)
+         return -1;
+      dec->quality = quality;
+      dec->rate_quality = rate_next_quality (quality, n, dec->target_size);
+      if (n <= dec->target_size || tries == RATE_RETRIES || quality == 1)
+         return n;
+
+      mjpeg_debug ("Frame of %d bytes at quality %d over target %ld",
+                   n, quality, dec->target_size);
+      if (dec->rate_quality >= quality)
+         dec->rate_quality = quality - 1;
+      quality = dec->rate_quality;
+   }
+}
+
+int encode_jpeg_raw_ctx (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len, int quality,
+                         int itype, int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2)
+{
+   long size = len;
+
+   return encode_rated (dec, &jpeg_data, &size, 0, quality, itype, ctype,
+                        width, height, raw0, raw1, raw2);
+}
+
+/*
+ * The buffer for encode_jpeg_raw_pool_ctx() is the largest idle one of
+ * the pool, or a new one.  It is grown up front to a little over the
+ * largest frame so far, so that it hardly ever has to grow while the
+ * frame is written.
+ */
+
+int encode_jpeg_raw_pool_ctx (jpeg2yuv_decoder_t *dec,
+                              unsigned char **jpeg_data, int quality,
+                              int itype, int ctype, int width, int height,
+                              unsigned char *raw0, unsigned char *raw1,
+                              unsigned char *raw2)
+{
+   pool_buf_t *pb = NULL;
+   long want;
+   int i, n;
+
+   for (i = 0; i < dec->npool; i++)
+      if (!dec->pool[i].busy && (pb == NULL || dec->pool[i].size > pb->size))
+         pb = &dec->pool[i];
+   if (pb == NULL) {
+      if (grow_buffer ((void **) &dec->pool, &dec->pool_size,
+                       (dec->npool + 1) * (long) sizeof (pool_buf_t)) < 0)
+         return -1;
+      pb = &dec->pool[dec->npool++];
+      pb->buf = NULL;
+      pb->size = 0;
+      pb->busy = 0;
+   }
+
+   /* no frame yet: guess half a byte per pixel, it doubles if short */
+   want = dec->enc_hwm ? dec->enc_hwm + dec->enc_hwm / 8
+                       : (long) width * height / 2;
+   if (grow_buffer ((void **) &pb->buf, &pb->size, want) < 0)
+      return -1;
+
+   n = encode_rated (dec, &pb->buf, &pb->size, 1, quality, itype, ctype,
+                     width, height, raw0, raw1, raw2);
+   if (n < 0)
+      return -1;
+   if (n > dec->enc_hwm)
+      dec->enc_hwm = n;
+   pb->busy = 1;
+   *jpeg_data = pb->buf;
+   return n;
+}
+
+void jpeg2yuv_decoder_release_jpeg (jpeg2yuv_decoder_t *dec,
+                                    unsigned char *jpeg_data)
+{
+   int i, idle = 0;
+
+   for (i = 0; i < dec->npool; i++)
+      if (!dec->pool[i].busy)
+         idle++;
+
+   for (i = 0; i < dec->npool; i++) {
+      if (!dec->pool[i].busy || dec->pool[i].buf != jpeg_data)
+         continue;
+      if (idle < POOL_KEEP) {
+         dec->pool[i].busy = 0;
+      } else {
+         free (dec->pool[i].buf);
+         dec->pool[i] = dec->pool[--dec->npool];
+      }
+      return;
+   }
+}
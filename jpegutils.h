@@ -32,14 +32,169 @@
  *                  Y4M_ILACE_TOP_FIRST: Interlaced, top-field-first
  *                  Y4M_ILACE_BOTTOM_FIRST: Interlaced, bottom-field-first
  * ctype            Chroma format for decompression.
- *                  Currently always 420 and hence ignored.
+ *                  Y4M_CHROMA_420JPEG (and anything unknown), _422,
+ *                  _444, _411 or _MONO when decoding; encoding
+ *                  supports 420JPEG and 422 only, written as 2x2 and
+ *                  2x1 subsampled JPEG.  The encoder takes any size,
+ *                  padding partial MCUs from the right and bottom edge.
  * raw0             buffer with input / output raw Y channel
  * raw1             buffer with input / output raw U/Cb channel
  * raw2             buffer with input / output raw V/Cr channel
- * width            width of Y channel (width of U/V is width/2)
- * height           height of Y channel (height of U/V is height/2)
+ *                  (not touched for Y4M_CHROMA_MONO; the gray decoder
+ *                  also accepts NULL and then leaves chroma to the
+ *                  caller)
+ * width            width of Y channel (width of U/V is width/2, width
+ *                  for 4:4:4, width/4 for 4:1:1)
+ * height           height of Y channel (height of U/V is height/2 for
+ *                  4:2:0, height otherwise)
  */
 
+/*
+ * Reentrant variants: calls passing the same context must not overlap,
+ * calls on different contexts may run concurrently from any number of
+ * threads.  The functions without the _ctx suffix share one internal
+ * context and are therefore not reentrant.  A context keeps its
+ * decompressor and compressor, with their tables, from one frame to
+ * the next, so it pays to use the same one for a whole sequence.
+ */
+
+typedef struct jpeg2yuv_decoder jpeg2yuv_decoder_t;
+
+jpeg2yuv_decoder_t *jpeg2yuv_decoder_create (void);
+void jpeg2yuv_decoder_destroy (jpeg2yuv_decoder_t *dec);
+
+/*
+ * on != 0: decoded samples are stored in studio range, Y as 16-235 and
+ * U/V as 16-240, instead of the full 0-255 of JPEG.  Off by default.
+ */
+void jpeg2yuv_decoder_set_studio_range (jpeg2yuv_decoder_t *dec, int on);
+
+/*
+ * threads > 1 (at most 16): frames whose restart interval is a whole
+ * number of MCU rows are cut at RSTn markers into that many bands,
+ * which are decoded concurrently, and the two images of a field pair
+ * are decoded at the same time.  Progressive and scaled frames and
+ * frames without such restart markers are decoded serially as before.
+ * Non-interlaced frames are also encoded in that many bands at once,
+ * which adds a restart marker after every MCU row.
+ * Default 1.  Returns -1 if out of memory.
+ */
+int jpeg2yuv_decoder_set_threads (jpeg2yuv_decoder_t *dec, int threads);
+
+/*
+ * Layout of the decoded chroma, for every ctype but MONO:
+ *   JPEG2YUV_LAYOUT_PLANAR   raw1 gets U (Cb), raw2 V (Cr), e.g. I420;
+ *                            the default
+ *   JPEG2YUV_LAYOUT_YV12     raw1 gets V, raw2 U
+ *   JPEG2YUV_LAYOUT_NV12     raw1 gets one plane of U,V pairs, rows of
+ *                            twice the chroma width; raw2 is unused
+ *   JPEG2YUV_LAYOUT_NV21     the same with V,U pairs
+ */
+#define JPEG2YUV_LAYOUT_PLANAR 0
+#define JPEG2YUV_LAYOUT_YV12   1
+#define JPEG2YUV_LAYOUT_NV12   2
+#define JPEG2YUV_LAYOUT_NV21   3
+
+void jpeg2yuv_decoder_set_layout (jpeg2yuv_decoder_t *dec, int layout);
+
+/*
+ * Which library decodes: JPEG2YUV_BACKEND_LIBJPEG, the default, or,
+ * if built with HAVE_TURBOJPEG, JPEG2YUV_BACKEND_TURBOJPEG.  The latter
+ * is only used by decode_jpeg_raw_ctx() for frames that need no
+ * resampling, cropping or interleaving, the rest still goes through
+ * libjpeg.  Returns -1 if the backend was not built in.
+ */
+#define JPEG2YUV_BACKEND_LIBJPEG   0
+#define JPEG2YUV_BACKEND_TURBOJPEG 1
+
+int jpeg2yuv_decoder_set_backend (jpeg2yuv_decoder_t *dec, int backend);
+
+/*
+ * Bytes per row of the raw0, raw1 and raw2 planes, for decoding into
+ * and encoding from surfaces with padded rows.  0 means packed, i.e.
+ * the width of the plane (for NV12/NV21 twice the chroma width).
+ * Default 0 for all three.
+ */
+void jpeg2yuv_decoder_set_pitch (jpeg2yuv_decoder_t *dec,
+                                 int pitch0, int pitch1, int pitch2);
+
+/*
+ * Decode only a w x h window of the image, top left corner at column
+ * x, row y (both rounded down to even).  The width and height passed
+ * to the decode calls are then fitted to the window as they are to the
+ * whole image otherwise, but without IDCT scaling; for a field pair
+ * the window applies to each field.  No rows below the window are
+ * decoded, and if the restart interval is a whole number of MCU rows
+ * decoding starts at the segment holding row y.  Cropped frames are
+ * not cut into restart bands.  w <= 0 or h <= 0 decodes whole images
+ * again, the default.
+ */
+void jpeg2yuv_decoder_set_crop (jpeg2yuv_decoder_t *dec,
+                                int x, int y, int w, int h);
+
+/*
+ * Rate control for the encode calls: bytes > 0 makes every frame aim
+ * at that size.  Their quality argument then only sets where the first
+ * frame starts; each later one is encoded at a quality worked out from
+ * the size of the frame before, and a frame that comes out larger than
+ * bytes is encoded again at a lower quality, at most twice.  0, the
+ * default, turns it off.  Setting it starts over from the next quality
+ * argument.
+ */
+void jpeg2yuv_decoder_set_target_size (jpeg2yuv_decoder_t *dec, long bytes);
+
+/* the quality the last frame was encoded at */
+int jpeg2yuv_decoder_get_quality (jpeg2yuv_decoder_t *dec);
+
+/*
+ * What a caller needs to know about a JPEG before decoding it, taken
+ * from the markers of the first image in the buffer without setting up
+ * a decompressor.  For a field pair that is the size of one field.
+ */
+typedef struct {
+   int width, height;
+   int components;              /* 1: grayscale, 3: YCbCr */
+   int h_samp[3], v_samp[3];    /* sampling factors of up to 3 components */
+   int progressive;
+} jpeg2yuv_info_t;
+
+/* returns 0, or -1 if no SOF marker was found */
+int jpeg2yuv_probe (const unsigned char *jpeg_data, long len,
+                    jpeg2yuv_info_t *info);
+
+int decode_jpeg_raw_ctx (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len,
+                         int itype, int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2);
+int decode_jpeg_gray_raw_ctx (jpeg2yuv_decoder_t *dec,
+                              unsigned char *jpeg_data, int len,
+                              int itype, int ctype, int width, int height,
+                              unsigned char *raw0, unsigned char *raw1,
+                              unsigned char *raw2);
+int encode_jpeg_raw_ctx (jpeg2yuv_decoder_t *dec,
+                         unsigned char *jpeg_data, int len, int quality,
+                         int itype, int ctype, int width, int height,
+                         unsigned char *raw0, unsigned char *raw1,
+                         unsigned char *raw2);
+
+/*
+ * encode_jpeg_raw_ctx() into a buffer of the context's own, which grows
+ * as needed instead of failing when a frame is larger than expected.
+ * Returns the size of the JPEG, or -1 on error, and leaves a pointer to
+ * it in *jpeg_data.  The buffer is the caller's until handed back with
+ * jpeg2yuv_decoder_release_jpeg(); the context keeps a few released
+ * ones to reuse, sized to the largest frame so far, and frees all of
+ * them, released or not, when destroyed.
+ */
+int encode_jpeg_raw_pool_ctx (jpeg2yuv_decoder_t *dec,
+                              unsigned char **jpeg_data, int quality,
+                              int itype, int ctype, int width, int height,
+                              unsigned char *raw0, unsigned char *raw1,
+                              unsigned char *raw2);
+void jpeg2yuv_decoder_release_jpeg (jpeg2yuv_decoder_t *dec,
+                                    unsigned char *jpeg_data);
+
 int decode_jpeg_raw (unsigned char *jpeg_data, int len,
                      int itype, int ctype, int width, int height,
                      unsigned char *raw0, unsigned char *raw1,
@@ -4,16 +4,33 @@
 #include <sys/time.h>
 #include "jpeglib.h"
 #include "jpegutils.h"
+
+#define BENCH_FRAMES 10
+
 int main(int argc, char **argv) {
 
     if (argc < 3) {
-        printf("usage: ./jpg2yuv inputfile outputfile\n");
+        printf("usage: ./jpg2yuv inputfile outputfile [i420|yv12|nv12|nv21]\n");
 
         return -1;
     }
 
     mjpeg_default_handler_verbosity(1);
 
+    int layout = JPEG2YUV_LAYOUT_PLANAR;
+    if (argc > 3) {
+        if (strcmp(argv[3], "yv12") == 0)
+            layout = JPEG2YUV_LAYOUT_YV12;
+        else if (strcmp(argv[3], "nv12") == 0)
+            layout = JPEG2YUV_LAYOUT_NV12;
+        else if (strcmp(argv[3], "nv21") == 0)
+            layout = JPEG2YUV_LAYOUT_NV21;
+        else if (strcmp(argv[3], "i420") != 0) {
+            printf("unknown output format: %s\n", argv[3]);
+            return -1;
+        }
+    }
+
     FILE *jpgFile = fopen(argv[1], "rb");
     if (jpgFile == NULL) {
         printf("fail to open jpg file: %s\n", argv[1]);
@@ -32,12 +49,41 @@ int main(int argc, char **argv) {
 
     char * yuvBuf = (char *) malloc(sizeof(char) * w * h * 3 / 2);
     char *yuvPtr[3] = {yuvBuf, yuvBuf + w * h, yuvBuf + w * h + w * h / 4};
-    struct timeval start;
-    gettimeofday(&start, NULL);
-    decode_jpeg_raw(jpgBuf, jpgSize, 0, 420, w, h , yuvPtr[0], yuvPtr[1], yuvPtr[2]);
-    struct timeval end;
-    gettimeofday(&end, NULL);
-    printf("decode use time: %dms\n", ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec) ) / 1000);
+    jpeg2yuv_decoder_t *dec = jpeg2yuv_decoder_create();
+    if (dec == NULL) {
+        printf("fail to create decoder\n");
+        return -1;
+    }
+    /* NV12/NV21 get the interleaved chroma plane straight from the decoder */
+    jpeg2yuv_decoder_set_layout(dec, layout);
+    /*
+     * Decode the same frame a few times with every backend built in and
+     * report the time per frame, the output is the libjpeg one.
+     */
+    static const char *backendName[] = {"libjpeg", "turbojpeg"};
+    int backend, frame;
+    for (backend = JPEG2YUV_BACKEND_TURBOJPEG; backend >= JPEG2YUV_BACKEND_LIBJPEG; backend--) {
+        if (jpeg2yuv_decoder_set_backend(dec, backend) < 0)
+            continue;
+        long total = 0, best = -1;
+        for (frame = 0; frame < BENCH_FRAMES; frame++) {
+            struct timeval start, end;
+            gettimeofday(&start, NULL);
+            if (decode_jpeg_raw_ctx(dec, jpgBuf, jpgSize, 0, 420, w, h , yuvPtr[0], yuvPtr[1], yuvPtr[2]) < 0) {
+                printf("%s: decode failed\n", backendName[backend]);
+                break;
+            }
+            gettimeofday(&end, NULL);
+            long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+            total += us;
+            if (best < 0 || us < best)
+                best = us;
+        }
+        if (frame == BENCH_FRAMES)
+            printf("%s decode time per frame: %.2fms avg, %.2fms min\n", backendName[backend],
+                   total / 1000.0 / BENCH_FRAMES, best / 1000.0);
+    }
+    jpeg2yuv_decoder_destroy(dec);
     FILE *yuvFile = fopen(argv[2], "wb");
     if (yuvFile == NULL) {
         printf("fail to open yuv file: %s\n", argv[2]);
@@ -0,0 +1,553 @@
+/*
+ *  yuv_resample.c: row kernels used by the raw JPEG decoder in
+ *                  jpegutils.c, with SIMD versions picked at runtime
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "yuv_resample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define YUV_RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+#define YUV_RESAMPLE_ARM 1
+#endif
+
+/*******************************************************************
+ *                                                                 *
+ *    Portable versions, these define the exact results            *
+ *                                                                 *
+ *******************************************************************/
+
+static void hdown_2to1_c (uint8_t *dst, const uint8_t *src, int n)
+{
+   int x;
+
+   for (x = 0; x < n; x++, src += 2)
+      dst[x] = (src[0] + src[1]) >> 1;
+}
+
+static void hdown_3to2_c (uint8_t *dst, const uint8_t *src, int n)
+{
+   int x;
+
+   for (x = 0; x < n; x += 2, src += 3) {
+      dst[x]     = (2 * src[0] + src[1]) / 3;
+      dst[x + 1] = (2 * src[2] + src[1]) / 3;
+   }
+}
+
+static void vavg_2to1_c (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                         int n)
+{
+   int x;
+
+   for (x = 0; x < n; x++)
+      dst[x] = (a[x] + b[x]) >> 1;
+}
+
+static void zip_c (uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+   int x;
+
+   for (x = 0; x < n; x++, dst += 2) {
+      dst[0] = a[x];
+      dst[1] = b[x];
+   }
+}
+
+/*
+ * (float) v / 255.0 * (235.0 - 16.0) + 16.0 and the same with 240.0,
+ * truncated, for v = 0..255
+ */
+
+const uint8_t yuv_range_luma_lut[256] = {
+    16,  16,  17,  18,  19,  20,  21,  22,  22,  23,  24,  25,  26,  27,  28,  28,
+    29,  30,  31,  32,  33,  34,  34,  35,  36,  37,  38,  39,  40,  40,  41,  42,
+    43,  44,  45,  46,  46,  47,  48,  49,  50,  51,  52,  52,  53,  54,  55,  56,
+    57,  58,  58,  59,  60,  61,  62,  63,  64,  64,  65,  66,  67,  68,  69,  70,
+    70,  71,  72,  73,  74,  75,  76,  76,  77,  78,  79,  80,  81,  82,  82,  83,
+    84,  85,  86,  87,  88,  89,  89,  90,  91,  92,  93,  94,  95,  95,  96,  97,
+    98,  99, 100, 101, 101, 102, 103, 104, 105, 106, 107, 107, 108, 109, 110, 111,
+   112, 113, 113, 114, 115, 116, 117, 118, 119, 119, 120, 121, 122, 123, 124, 125,
+   125, 126, 127, 128, 129, 130, 131, 131, 132, 133, 134, 135, 136, 137, 137, 138,
+   139, 140, 141, 142, 143, 143, 144, 145, 146, 147, 148, 149, 149, 150, 151, 152,
+   153, 154, 155, 155, 156, 157, 158, 159, 160, 161, 162, 162, 163, 164, 165, 166,
+   167, 168, 168, 169, 170, 171, 172, 173, 174, 174, 175, 176, 177, 178, 179, 180,
+   180, 181, 182, 183, 184, 185, 186, 186, 187, 188, 189, 190, 191, 192, 192, 193,
+   194, 195, 196, 197, 198, 198, 199, 200, 201, 202, 203, 204, 204, 205, 206, 207,
+   208, 209, 210, 210, 211, 212, 213, 214, 215, 216, 216, 217, 218, 219, 220, 221,
+   222, 222, 223, 224, 225, 226, 227, 228, 228, 229, 230, 231, 232, 233, 234, 235
+};
+
+const uint8_t yuv_range_chroma_lut[256] = {
+    16,  16,  17,  18,  19,  20,  21,  22,  23,  23,  24,  25,  26,  27,  28,  29,
+    30,  30,  31,  32,  33,  34,  35,  36,  37,  37,  38,  39,  40,  41,  42,  43,
+    44,  44,  45,  46,  47,  48,  49,  50,  51,  52,  52,  53,  54,  55,  56,  57,
+    58,  59,  59,  60,  61,  62,  63,  64,  65,  66,  66,  67,  68,  69,  70,  71,
+    72,  73,  73,  74,  75,  76,  77,  78,  79,  80,  81,  81,  82,  83,  84,  85,
+    86,  87,  88,  88,  89,  90,  91,  92,  93,  94,  95,  95,  96,  97,  98,  99,
+   100, 101, 102, 102, 103, 104, 105, 106, 107, 108, 109, 109, 110, 111, 112, 113,
+   114, 115, 116, 117, 117, 118, 119, 120, 121, 122, 123, 124, 124, 125, 126, 127,
+   128, 129, 130, 131, 131, 132, 133, 134, 135, 136, 137, 138, 138, 139, 140, 141,
+   142, 143, 144, 145, 146, 146, 147, 148, 149, 150, 151, 152, 153, 153, 154, 155,
+   156, 157, 158, 159, 160, 160, 161, 162, 163, 164, 165, 166, 167, 167, 168, 169,
+   170, 171, 172, 173, 174, 174, 175, 176, 177, 178, 179, 180, 181, 182, 182, 183,
+   184, 185, 186, 187, 188, 189, 189, 190, 191, 192, 193, 194, 195, 196, 196, 197,
+   198, 199, 200, 201, 202, 203, 203, 204, 205, 206, 207, 208, 209, 210, 211, 211,
+   212, 213, 214, 215, 216, 217, 218, 218, 219, 220, 221, 222, 223, 224, 225, 225,
+   226, 227, 228, 229, 230, 231, 232, 232, 233, 234, 235, 236, 237, 238, 239, 240
+};
+
+static void range_luma_c (uint8_t *dst, const uint8_t *src, int n)
+{
+   int x;
+
+   for (x = 0; x < n; x++)
+      dst[x] = yuv_range_luma_lut[src[x]];
+}
+
+static void range_chroma_c (uint8_t *dst, const uint8_t *src, int n)
+{
+   int x;
+
+   for (x = 0; x < n; x++)
+      dst[x] = yuv_range_chroma_lut[src[x]];
+}
+
+void (*yuv_hdown_2to1) (uint8_t *dst, const uint8_t *src, int n) = hdown_2to1_c;
+void (*yuv_hdown_3to2) (uint8_t *dst, const uint8_t *src, int n) = hdown_3to2_c;
+void (*yuv_vavg_2to1) (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                       int n) = vavg_2to1_c;
+void (*yuv_zip) (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                 int n) = zip_c;
+void (*yuv_range_luma) (uint8_t *dst, const uint8_t *src, int n) = range_luma_c;
+void (*yuv_range_chroma) (uint8_t *dst, const uint8_t *src, int n) =
+   range_chroma_c;
+
+/*
+ * The SIMD versions never see more than 765 (= 3 * 255) before dividing
+ * by 3, so x / 3 == (x * 21846) >> 16 holds for every input and the
+ * division becomes a 16 bit high multiply.
+ */
+
+#define DIV3_MUL 21846
+
+/*
+ * The range tables are also reproduced exactly, for every input, by
+ * 16 + ((v * MUL + ADD) >> 16) with the constants below (found by
+ * exhaustive search), which is what the SIMD versions compute.
+ */
+
+#define RANGE_LUMA_MUL   56280
+#define RANGE_LUMA_ADD     984
+#define RANGE_CHROMA_MUL 57566
+#define RANGE_CHROMA_ADD   734
+
+/*******************************************************************
+ *                                                                 *
+ *    x86: SSE2, SSSE3 and AVX2                                    *
+ *                                                                 *
+ *******************************************************************/
+
+#ifdef YUV_RESAMPLE_X86
+
+/* floor((a + b) / 2): pavgb rounds up, so take the carry back off */
+
+#define AVG_FLOOR_SSE2(a, b) \
+   _mm_sub_epi8 (_mm_avg_epu8 ((a), (b)), \
+                 _mm_and_si128 (_mm_xor_si128 ((a), (b)), _mm_set1_epi8 (1)))
+
+__attribute__ ((target ("sse2")))
+static void hdown_2to1_sse2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   const __m128i lo = _mm_set1_epi16 (0x00ff);
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16, src += 32) {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (src + 16));
+      __m128i even = _mm_packus_epi16 (_mm_and_si128 (a, lo),
+                                       _mm_and_si128 (b, lo));
+      __m128i odd = _mm_packus_epi16 (_mm_srli_epi16 (a, 8),
+                                      _mm_srli_epi16 (b, 8));
+      _mm_storeu_si128 ((__m128i *) (dst + x), AVG_FLOOR_SSE2 (even, odd));
+   }
+   hdown_2to1_c (dst + x, src, n - x);
+}
+
+__attribute__ ((target ("avx2")))
+static void hdown_2to1_avx2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   const __m256i lo = _mm256_set1_epi16 (0x00ff);
+   const __m256i one = _mm256_set1_epi8 (1);
+   int x;
+
+   for (x = 0; x + 32 <= n; x += 32, src += 64) {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) src);
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (src + 32));
+      /* packus works per 128 bit lane, the permute puts the quads back */
+      __m256i even = _mm256_permute4x64_epi64 (
+         _mm256_packus_epi16 (_mm256_and_si256 (a, lo),
+                              _mm256_and_si256 (b, lo)), 0xd8);
+      __m256i odd = _mm256_permute4x64_epi64 (
+         _mm256_packus_epi16 (_mm256_srli_epi16 (a, 8),
+                              _mm256_srli_epi16 (b, 8)), 0xd8);
+      __m256i avg = _mm256_sub_epi8 (_mm256_avg_epu8 (even, odd),
+                       _mm256_and_si256 (_mm256_xor_si256 (even, odd), one));
+      _mm256_storeu_si256 ((__m256i *) (dst + x), avg);
+   }
+   hdown_2to1_sse2 (dst + x, src, n - x);
+}
+
+__attribute__ ((target ("sse2")))
+static void vavg_2to1_sse2 (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                            int n)
+{
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16) {
+      __m128i va = _mm_loadu_si128 ((const __m128i *) (a + x));
+      __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + x));
+      _mm_storeu_si128 ((__m128i *) (dst + x), AVG_FLOOR_SSE2 (va, vb));
+   }
+   vavg_2to1_c (dst + x, a + x, b + x, n - x);
+}
+
+__attribute__ ((target ("avx2")))
+static void vavg_2to1_avx2 (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                            int n)
+{
+   const __m256i one = _mm256_set1_epi8 (1);
+   int x;
+
+   for (x = 0; x + 32 <= n; x += 32) {
+      __m256i va = _mm256_loadu_si256 ((const __m256i *) (a + x));
+      __m256i vb = _mm256_loadu_si256 ((const __m256i *) (b + x));
+      __m256i avg = _mm256_sub_epi8 (_mm256_avg_epu8 (va, vb),
+                       _mm256_and_si256 (_mm256_xor_si256 (va, vb), one));
+      _mm256_storeu_si256 ((__m256i *) (dst + x), avg);
+   }
+   vavg_2to1_sse2 (dst + x, a + x, b + x, n - x);
+}
+
+__attribute__ ((target ("sse2")))
+static void zip_sse2 (uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16, dst += 32) {
+      __m128i va = _mm_loadu_si128 ((const __m128i *) (a + x));
+      __m128i vb = _mm_loadu_si128 ((const __m128i *) (b + x));
+      _mm_storeu_si128 ((__m128i *) dst, _mm_unpacklo_epi8 (va, vb));
+      _mm_storeu_si128 ((__m128i *) (dst + 16), _mm_unpackhi_epi8 (va, vb));
+   }
+   zip_c (dst, a + x, b + x, n - x);
+}
+
+__attribute__ ((target ("avx2")))
+static void zip_avx2 (uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+   int x;
+
+   /* unpack works per 128 bit lane, the permutes put the halves in order */
+   for (x = 0; x + 32 <= n; x += 32, dst += 64) {
+      __m256i va = _mm256_loadu_si256 ((const __m256i *) (a + x));
+      __m256i vb = _mm256_loadu_si256 ((const __m256i *) (b + x));
+      __m256i lo = _mm256_unpacklo_epi8 (va, vb);
+      __m256i hi = _mm256_unpackhi_epi8 (va, vb);
+      _mm256_storeu_si256 ((__m256i *) dst,
+                           _mm256_permute2x128_si256 (lo, hi, 0x20));
+      _mm256_storeu_si256 ((__m256i *) (dst + 32),
+                           _mm256_permute2x128_si256 (lo, hi, 0x31));
+   }
+   zip_sse2 (dst, a + x, b + x, n - x);
+}
+
+/*
+ * Range mapping on 16 bit lanes: mulhi gives the high half of v * MUL,
+ * adding ADD to the low half carries into it exactly when
+ * lo >= 65536 - ADD.  The compare yields -1 there, hence the subtract.
+ */
+
+#define RANGE_MAP_SSE2(v, m, lim) \
+   _mm_sub_epi16 (_mm_add_epi16 (_mm_mulhi_epu16 ((v), (m)), \
+                                 _mm_set1_epi16 (16)), \
+                  _mm_cmpeq_epi16 (_mm_subs_epu16 ((lim), \
+                                      _mm_mullo_epi16 ((v), (m))), \
+                                   _mm_setzero_si128 ()))
+
+#define RANGE_MAP_AVX2(v, m, lim) \
+   _mm256_sub_epi16 (_mm256_add_epi16 (_mm256_mulhi_epu16 ((v), (m)), \
+                                       _mm256_set1_epi16 (16)), \
+                     _mm256_cmpeq_epi16 (_mm256_subs_epu16 ((lim), \
+                                            _mm256_mullo_epi16 ((v), (m))), \
+                                         _mm256_setzero_si256 ()))
+
+__attribute__ ((target ("sse2")))
+static void range_map_sse2 (uint8_t *dst, const uint8_t *src, int n,
+                            int mul, int add, const uint8_t *lut)
+{
+   const __m128i m = _mm_set1_epi16 ((short) mul);
+   const __m128i lim = _mm_set1_epi16 ((short) (65536 - add));
+   const __m128i zero = _mm_setzero_si128 ();
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (src + x));
+      __m128i lo = _mm_unpacklo_epi8 (v, zero);
+      __m128i hi = _mm_unpackhi_epi8 (v, zero);
+      _mm_storeu_si128 ((__m128i *) (dst + x),
+                        _mm_packus_epi16 (RANGE_MAP_SSE2 (lo, m, lim),
+                                          RANGE_MAP_SSE2 (hi, m, lim)));
+   }
+   for (; x < n; x++)
+      dst[x] = lut[src[x]];
+}
+
+__attribute__ ((target ("avx2")))
+static void range_map_avx2 (uint8_t *dst, const uint8_t *src, int n,
+                            int mul, int add, const uint8_t *lut)
+{
+   const __m256i m = _mm256_set1_epi16 ((short) mul);
+   const __m256i lim = _mm256_set1_epi16 ((short) (65536 - add));
+   const __m256i zero = _mm256_setzero_si256 ();
+   int x;
+
+   /* unpack and pack both work per 128 bit lane, so no permute needed */
+   for (x = 0; x + 32 <= n; x += 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (src + x));
+      __m256i lo = _mm256_unpacklo_epi8 (v, zero);
+      __m256i hi = _mm256_unpackhi_epi8 (v, zero);
+      _mm256_storeu_si256 ((__m256i *) (dst + x),
+                           _mm256_packus_epi16 (RANGE_MAP_AVX2 (lo, m, lim),
+                                                RANGE_MAP_AVX2 (hi, m, lim)));
+   }
+   range_map_sse2 (dst + x, src + x, n - x, mul, add, lut);
+}
+
+static void range_luma_sse2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   range_map_sse2 (dst, src, n, RANGE_LUMA_MUL, RANGE_LUMA_ADD,
+                   yuv_range_luma_lut);
+}
+
+static void range_chroma_sse2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   range_map_sse2 (dst, src, n, RANGE_CHROMA_MUL, RANGE_CHROMA_ADD,
+                   yuv_range_chroma_lut);
+}
+
+static void range_luma_avx2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   range_map_avx2 (dst, src, n, RANGE_LUMA_MUL, RANGE_LUMA_ADD,
+                   yuv_range_luma_lut);
+}
+
+static void range_chroma_avx2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   range_map_avx2 (dst, src, n, RANGE_CHROMA_MUL, RANGE_CHROMA_ADD,
+                   yuv_range_chroma_lut);
+}
+
+/*
+ * 3:2 needs a stride 3 gather, which plain SSE2 has no shuffle for, so
+ * the 128 bit version uses SSSE3 pshufb.  One step reads 24 source
+ * bytes (as two overlapping 16 byte loads at +0 and +8) and writes 16.
+ * The masks below zero-extend src[3k], src[3k+1], src[3k+2] of
+ * k = 0..7 into 16 bit lanes, taking bytes 0..15 from the first load
+ * and bytes 16..23 from the second.
+ */
+
+#define Z 0x80
+static const uint8_t shuf3_a_lo[16] = { 0,Z, 3,Z, 6,Z, 9,Z, 12,Z, 15,Z, Z,Z, Z,Z };
+static const uint8_t shuf3_a_hi[16] = { Z,Z, Z,Z, Z,Z, Z,Z, Z,Z,  Z,Z, 10,Z, 13,Z };
+static const uint8_t shuf3_b_lo[16] = { 1,Z, 4,Z, 7,Z, 10,Z, 13,Z, Z,Z, Z,Z, Z,Z };
+static const uint8_t shuf3_b_hi[16] = { Z,Z, Z,Z, Z,Z, Z,Z,  Z,Z,  8,Z, 11,Z, 14,Z };
+static const uint8_t shuf3_c_lo[16] = { 2,Z, 5,Z, 8,Z, 11,Z, 14,Z, Z,Z, Z,Z, Z,Z };
+static const uint8_t shuf3_c_hi[16] = { Z,Z, Z,Z, Z,Z, Z,Z,  Z,Z,  9,Z, 12,Z, 15,Z };
+#undef Z
+
+#define LOAD_MASK(m) _mm_loadu_si128 ((const __m128i *) (m))
+
+__attribute__ ((target ("ssse3")))
+static void hdown_3to2_ssse3 (uint8_t *dst, const uint8_t *src, int n)
+{
+   const __m128i a_lo = LOAD_MASK (shuf3_a_lo), a_hi = LOAD_MASK (shuf3_a_hi);
+   const __m128i b_lo = LOAD_MASK (shuf3_b_lo), b_hi = LOAD_MASK (shuf3_b_hi);
+   const __m128i c_lo = LOAD_MASK (shuf3_c_lo), c_hi = LOAD_MASK (shuf3_c_hi);
+   const __m128i div3 = _mm_set1_epi16 (DIV3_MUL);
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16, src += 24) {
+      __m128i l = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i h = _mm_loadu_si128 ((const __m128i *) (src + 8));
+      __m128i a = _mm_or_si128 (_mm_shuffle_epi8 (l, a_lo),
+                                _mm_shuffle_epi8 (h, a_hi));
+      __m128i b = _mm_or_si128 (_mm_shuffle_epi8 (l, b_lo),
+                                _mm_shuffle_epi8 (h, b_hi));
+      __m128i c = _mm_or_si128 (_mm_shuffle_epi8 (l, c_lo),
+                                _mm_shuffle_epi8 (h, c_hi));
+      __m128i p = _mm_mulhi_epu16 (_mm_add_epi16 (_mm_add_epi16 (a, a), b),
+                                   div3);
+      __m128i q = _mm_mulhi_epu16 (_mm_add_epi16 (_mm_add_epi16 (c, c), b),
+                                   div3);
+      /* p in the low, q in the high byte: p0 q0 p1 q1 ... */
+      _mm_storeu_si128 ((__m128i *) (dst + x),
+                        _mm_or_si128 (p, _mm_slli_epi16 (q, 8)));
+   }
+   hdown_3to2_c (dst + x, src, n - x);
+}
+
+#define LOAD_MASK2(m) _mm256_broadcastsi128_si256 (LOAD_MASK (m))
+#define LOAD_2X128(p0, p1) \
+   _mm256_inserti128_si256 ( \
+      _mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) (p0))), \
+      _mm_loadu_si128 ((const __m128i *) (p1)), 1)
+
+__attribute__ ((target ("avx2")))
+static void hdown_3to2_avx2 (uint8_t *dst, const uint8_t *src, int n)
+{
+   const __m256i a_lo = LOAD_MASK2 (shuf3_a_lo), a_hi = LOAD_MASK2 (shuf3_a_hi);
+   const __m256i b_lo = LOAD_MASK2 (shuf3_b_lo), b_hi = LOAD_MASK2 (shuf3_b_hi);
+   const __m256i c_lo = LOAD_MASK2 (shuf3_c_lo), c_hi = LOAD_MASK2 (shuf3_c_hi);
+   const __m256i div3 = _mm256_set1_epi16 (DIV3_MUL);
+   int x;
+
+   /* lane 0 handles src[0..23], lane 1 src[24..47] */
+   for (x = 0; x + 32 <= n; x += 32, src += 48) {
+      __m256i l = LOAD_2X128 (src, src + 24);
+      __m256i h = LOAD_2X128 (src + 8, src + 32);
+      __m256i a = _mm256_or_si256 (_mm256_shuffle_epi8 (l, a_lo),
+                                   _mm256_shuffle_epi8 (h, a_hi));
+      __m256i b = _mm256_or_si256 (_mm256_shuffle_epi8 (l, b_lo),
+                                   _mm256_shuffle_epi8 (h, b_hi));
+      __m256i c = _mm256_or_si256 (_mm256_shuffle_epi8 (l, c_lo),
+                                   _mm256_shuffle_epi8 (h, c_hi));
+      __m256i p = _mm256_mulhi_epu16 (
+         _mm256_add_epi16 (_mm256_add_epi16 (a, a), b), div3);
+      __m256i q = _mm256_mulhi_epu16 (
+         _mm256_add_epi16 (_mm256_add_epi16 (c, c), b), div3);
+      _mm256_storeu_si256 ((__m256i *) (dst + x),
+                           _mm256_or_si256 (p, _mm256_slli_epi16 (q, 8)));
+   }
+   hdown_3to2_ssse3 (dst + x, src, n - x);
+}
+
+#endif /* YUV_RESAMPLE_X86 */
+
+/*******************************************************************
+ *                                                                 *
+ *    ARM: NEON, see yuv_resample_neon.c                           *
+ *                                                                 *
+ *******************************************************************/
+
+#ifdef YUV_RESAMPLE_ARM
+
+void yuv_hdown_2to1_neon (uint8_t *dst, const uint8_t *src, int n);
+void yuv_hdown_3to2_neon (uint8_t *dst, const uint8_t *src, int n);
+void yuv_vavg_2to1_neon (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                         int n);
+void yuv_zip_neon (uint8_t *dst, const uint8_t *a, const uint8_t *b, int n);
+void yuv_range_luma_neon (uint8_t *dst, const uint8_t *src, int n);
+void yuv_range_chroma_neon (uint8_t *dst, const uint8_t *src, int n);
+
+#ifdef __aarch64__
+static int have_neon (void)
+{
+   return 1;
+}
+#else
+/*
+ * getauxval() only exists from Android API 18 on, so read the aux
+ * vector directly.  AT_HWCAP is 16, HWCAP_NEON is bit 12.
+ */
+static int have_neon (void)
+{
+   unsigned long entry[2];
+   int neon = 0;
+   FILE *f = fopen ("/proc/self/auxv", "rb");
+
+   if (f == NULL)
+      return 0;
+   while (fread (entry, sizeof (entry), 1, f) == 1 && entry[0] != 0) {
+      if (entry[0] == 16) {
+         neon = (entry[1] & (1 << 12)) != 0;
+         break;
+      }
+   }
+   fclose (f);
+   return neon;
+}
+#endif
+
+#endif /* YUV_RESAMPLE_ARM */
+
+/*******************************************************************
+ *                                                                 *
+ *    Runtime selection                                            *
+ *                                                                 *
+ *******************************************************************/
+
+static pthread_once_t resample_once = PTHREAD_ONCE_INIT;
+
+static void resample_select (void)
+{
+#ifdef YUV_RESAMPLE_X86
+   __builtin_cpu_init ();
+   if (__builtin_cpu_supports ("sse2")) {
+      yuv_hdown_2to1 = hdown_2to1_sse2;
+      yuv_vavg_2to1 = vavg_2to1_sse2;
+      yuv_zip = zip_sse2;
+      yuv_range_luma = range_luma_sse2;
+      yuv_range_chroma = range_chroma_sse2;
+   }
+   if (__builtin_cpu_supports ("ssse3"))
+      yuv_hdown_3to2 = hdown_3to2_ssse3;
+   if (__builtin_cpu_supports ("avx2")) {
+      yuv_hdown_2to1 = hdown_2to1_avx2;
+      yuv_hdown_3to2 = hdown_3to2_avx2;
+      yuv_vavg_2to1 = vavg_2to1_avx2;
+      yuv_zip = zip_avx2;
+      yuv_range_luma = range_luma_avx2;
+      yuv_range_chroma = range_chroma_avx2;
+   }
+#endif
+#ifdef YUV_RESAMPLE_ARM
+   if (have_neon ()) {
+      yuv_hdown_2to1 = yuv_hdown_2to1_neon;
+      yuv_hdown_3to2 = yuv_hdown_3to2_neon;
+      yuv_vavg_2to1 = yuv_vavg_2to1_neon;
+      yuv_zip = yuv_zip_neon;
+      yuv_range_luma = yuv_range_luma_neon;
+      yuv_range_chroma = yuv_range_chroma_neon;
+   }
+#endif
+}
+
+void yuv_resample_init (void)
+{
+   pthread_once (&resample_once, resample_select);
+}
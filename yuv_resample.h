@@ -0,0 +1,67 @@
+/*
+ *  yuv_resample.h: row kernels used by the raw JPEG decoder in
+ *                  jpegutils.c, with SIMD versions picked at runtime
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef __YUV_RESAMPLE_H__
+#define __YUV_RESAMPLE_H__
+
+#include "mjpeg_types.h"
+
+/*
+ * All kernels produce exactly the same bytes as the scalar loops they
+ * replace, whatever implementation yuv_resample_init() selected.
+ *
+ * yuv_hdown_2to1:  dst[i] = (src[2i] + src[2i+1]) >> 1
+ *                  n output samples
+ * yuv_hdown_3to2:  dst[2k]   = (2 * src[3k]   + src[3k+1]) / 3
+ *                  dst[2k+1] = (2 * src[3k+2] + src[3k+1]) / 3
+ *                  n output samples, n must be even
+ * yuv_vavg_2to1:   dst[i] = (a[i] + b[i]) >> 1
+ *                  averages two rows of n samples into one
+ * yuv_zip:         dst[2i] = a[i], dst[2i+1] = b[i]
+ *                  interleaves two rows of n samples, as for NV12
+ */
+
+extern void (*yuv_hdown_2to1) (uint8_t *dst, const uint8_t *src, int n);
+extern void (*yuv_hdown_3to2) (uint8_t *dst, const uint8_t *src, int n);
+extern void (*yuv_vavg_2to1) (uint8_t *dst, const uint8_t *a,
+                              const uint8_t *b, int n);
+extern void (*yuv_zip) (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                        int n);
+
+/*
+ * Full range (0-255) to studio range, as jpeg2yuv -R 1 does it:
+ * Y to 16-235, Cb/Cr to 16-240.  The tables hold the exact results of
+ * the float expression jpeg2yuv used to evaluate per sample; the
+ * kernels map n samples and may be called with dst == src.
+ */
+
+extern const uint8_t yuv_range_luma_lut[256];
+extern const uint8_t yuv_range_chroma_lut[256];
+
+extern void (*yuv_range_luma) (uint8_t *dst, const uint8_t *src, int n);
+extern void (*yuv_range_chroma) (uint8_t *dst, const uint8_t *src, int n);
+
+/*
+ * Select the fastest implementation for this CPU.  Safe to call any
+ * number of times from any thread; until the first call the portable
+ * C versions are used.
+ */
+
+void yuv_resample_init (void);
+
+#endif
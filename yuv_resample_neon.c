@@ -0,0 +1,148 @@
+/*
+ *  yuv_resample_neon.c: NEON versions of the yuv_resample.c kernels.
+ *                       Built with NEON enabled (".neon" suffix in
+ *                       Android.mk) and only called when
+ *                       yuv_resample_init() found NEON on the CPU.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "yuv_resample.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON) || defined(__aarch64__)
+
+#include <arm_neon.h>
+
+/* see yuv_resample.c */
+#define DIV3_MUL 21846
+#define RANGE_LUMA_MUL   56280
+#define RANGE_LUMA_ADD     984
+#define RANGE_CHROMA_MUL 57566
+#define RANGE_CHROMA_ADD   734
+
+void yuv_hdown_2to1_neon (uint8_t *dst, const uint8_t *src, int n)
+{
+   int x;
+
+   /* vhadd is the truncating halving add, i.e. exactly (a + b) >> 1 */
+   for (x = 0; x + 16 <= n; x += 16, src += 32) {
+      uint8x16x2_t s = vld2q_u8 (src);
+      vst1q_u8 (dst + x, vhaddq_u8 (s.val[0], s.val[1]));
+   }
+   for (; x < n; x++, src += 2)
+      dst[x] = (src[0] + src[1]) >> 1;
+}
+
+void yuv_vavg_2to1_neon (uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                         int n)
+{
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16)
+      vst1q_u8 (dst + x, vhaddq_u8 (vld1q_u8 (a + x), vld1q_u8 (b + x)));
+   for (; x < n; x++)
+      dst[x] = (a[x] + b[x]) >> 1;
+}
+
+/* vst2 stores the two registers interleaved */
+
+void yuv_zip_neon (uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16, dst += 32) {
+      uint8x16x2_t d;
+
+      d.val[0] = vld1q_u8 (a + x);
+      d.val[1] = vld1q_u8 (b + x);
+      vst2q_u8 (dst, d);
+   }
+   for (; x < n; x++, dst += 2) {
+      dst[0] = a[x];
+      dst[1] = b[x];
+   }
+}
+
+static inline uint8x8_t div3_u16 (uint16x8_t v)
+{
+   const uint16x4_t m = vdup_n_u16 (DIV3_MUL);
+   uint16x4_t lo = vshrn_n_u32 (vmull_u16 (vget_low_u16 (v), m), 16);
+   uint16x4_t hi = vshrn_n_u32 (vmull_u16 (vget_high_u16 (v), m), 16);
+
+   return vmovn_u16 (vcombine_u16 (lo, hi));
+}
+
+void yuv_hdown_3to2_neon (uint8_t *dst, const uint8_t *src, int n)
+{
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16, src += 24) {
+      uint8x8x3_t s = vld3_u8 (src);
+      uint8x8x2_t d;
+      uint16x8_t b = vmovl_u8 (s.val[1]);
+
+      d.val[0] = div3_u16 (vaddq_u16 (vshll_n_u8 (s.val[0], 1), b));
+      d.val[1] = div3_u16 (vaddq_u16 (vshll_n_u8 (s.val[2], 1), b));
+      vst2_u8 (dst + x, d);
+   }
+   for (; x < n; x += 2, src += 3) {
+      dst[x]     = (2 * src[0] + src[1]) / 3;
+      dst[x + 1] = (2 * src[2] + src[1]) / 3;
+   }
+}
+
+/* 16 + ((v * mul + add) >> 16) on widened lanes, cf. yuv_resample.c */
+
+static void range_map_neon (uint8_t *dst, const uint8_t *src, int n,
+                            int mul, int add, const uint8_t *lut)
+{
+   const uint16x4_t m = vdup_n_u16 (mul);
+   const uint32x4_t a = vdupq_n_u32 ((16 << 16) + add);
+   int x;
+
+   for (x = 0; x + 16 <= n; x += 16) {
+      uint8x16_t v = vld1q_u8 (src + x);
+      uint16x8_t lo = vmovl_u8 (vget_low_u8 (v));
+      uint16x8_t hi = vmovl_u8 (vget_high_u8 (v));
+      uint16x8_t rlo = vcombine_u16 (
+         vshrn_n_u32 (vmlal_u16 (a, vget_low_u16 (lo), m), 16),
+         vshrn_n_u32 (vmlal_u16 (a, vget_high_u16 (lo), m), 16));
+      uint16x8_t rhi = vcombine_u16 (
+         vshrn_n_u32 (vmlal_u16 (a, vget_low_u16 (hi), m), 16),
+         vshrn_n_u32 (vmlal_u16 (a, vget_high_u16 (hi), m), 16));
+
+      vst1q_u8 (dst + x, vcombine_u8 (vmovn_u16 (rlo), vmovn_u16 (rhi)));
+   }
+   for (; x < n; x++)
+      dst[x] = lut[src[x]];
+}
+
+void yuv_range_luma_neon (uint8_t *dst, const uint8_t *src, int n)
+{
+   range_map_neon (dst, src, n, RANGE_LUMA_MUL, RANGE_LUMA_ADD,
+                   yuv_range_luma_lut);
+}
+
+void yuv_range_chroma_neon (uint8_t *dst, const uint8_t *src, int n)
+{
+   range_map_neon (dst, src, n, RANGE_CHROMA_MUL, RANGE_CHROMA_ADD,
+                   yuv_range_chroma_lut);
+}
+
+#endif